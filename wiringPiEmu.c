@@ -33,7 +33,8 @@
 // GPIO Emulation using RT POSIX signals
 //-------------------------------------------------------------------
 
-#define GPIO_MAX 15
+//Pins with RT signal => (SIGRTMAX-SIGRTMIN+1)/2. The rest can only be driven by the emulated expanders.
+#define GPIO_MAX 32
 
 //GPIO Emulation Data Structure
 struct gpio_pin {
@@ -58,6 +59,22 @@ void signal_handler(int signo) {
 	}
 }
 
+//MCP23017 Emulation Data Structure
+struct mcp23017_emu_st {
+	int pin_base;		// -1 => not set up
+	struct wiringPiNodeStruct node;
+	unsigned char regs[0x16];	// IOCON.BANK=0 register layout
+	int int_pins[2];
+	int int_pending[2];
+	int deferred;
+};
+struct mcp23017_emu_st mcp23017_emu={ .pin_base=-1, .int_pins={-1,-1} };
+
+int mcp23017_emu_bit(int pin) {
+	if (mcp23017_emu.pin_base<0 || pin<mcp23017_emu.pin_base || pin>=mcp23017_emu.pin_base+16) return -1;
+	return pin-mcp23017_emu.pin_base;
+}
+
 //-------------------------------------------------------------------
 // WiringPi Library Emulation
 //-------------------------------------------------------------------
@@ -74,7 +91,7 @@ int wiringPiSetup(void) {
 		gpio[i].status=0;
 	}
 	//Setup Signal Catching for GPIO Emulation
-	for (i=0;i<2*GPIO_MAX;i++) {
+	for (i=0;i<2*GPIO_MAX && SIGRTMIN+i<=SIGRTMAX;i++) {
 		signo=SIGRTMIN+i;
 		if (signal(signo,signal_handler)==SIG_ERR) {
 			printf("ERROR WiringPiEmu: Can't catch signal %d\n",signo);
@@ -88,6 +105,12 @@ int mcp23008Setup(int pin_offset, int addr_base) {
 }
 
 void pinMode(int pin, int mode) {
+	int bit=mcp23017_emu_bit(pin);
+	if (bit>=0) {
+		if (mode==INPUT) mcp23017_emu.regs[MCP23x17_IODIRA+(bit>>3)] |= 1<<(bit&7);
+		else mcp23017_emu.regs[MCP23x17_IODIRA+(bit>>3)] &= ~(1<<(bit&7));
+		return;
+	}
 	if (pin>=GPIO_MAX) {
 		printf("ERROR WiringPiEmu: pin number (%d) is out of range\n",pin);
 		return;
@@ -96,6 +119,12 @@ void pinMode(int pin, int mode) {
 }
 
 void pullUpDnControl(int pin, int pud) {
+	int bit=mcp23017_emu_bit(pin);
+	if (bit>=0) {
+		if (pud==PUD_UP) mcp23017_emu.regs[MCP23x17_GPPUA+(bit>>3)] |= 1<<(bit&7);
+		else mcp23017_emu.regs[MCP23x17_GPPUA+(bit>>3)] &= ~(1<<(bit&7));
+		return;
+	}
 	if (pin>=GPIO_MAX) {
 		printf("ERROR WiringPiEmu: pin number (%d) is out of range\n",pin);
 		return;
@@ -115,6 +144,8 @@ void digitalWrite(int pin, int value) {
 }
 
 int digitalRead(int pin) {
+	int bit=mcp23017_emu_bit(pin);
+	if (bit>=0) return (mcp23017_emu.regs[MCP23x17_GPIOA+(bit>>3)]>>(bit&7)) & 0x01;
 	if (pin>=GPIO_MAX) {
 		printf("ERROR WiringPiEmu: pin number (%d) is out of range\n",pin);
 		return 0;
@@ -131,3 +162,112 @@ int wiringPiISR(int pin, int mode, void (*function)(void)) {
 	gpio[pin].isrfunc=function;
 	return 1;
 }
+
+//-------------------------------------------------------------------
+// MCP23017 Emulation
+//-------------------------------------------------------------------
+//	Only the input side is emulated: interrupt-on-change (or compare
+//	to DEFVAL), INTF/INTCAP latching until INTCAP or GPIO is read, and
+//	active-high INT outputs driving the configured GPIOs.
+
+int mcp23017Setup(int pin_base, int addr) {
+	int i;
+	mcp23017_emu.pin_base=pin_base;
+	mcp23017_emu.node.pinBase=pin_base;
+	mcp23017_emu.node.pinMax=pin_base+15;
+	mcp23017_emu.node.fd=addr;
+	for (i=0;i<0x16;i++) mcp23017_emu.regs[i]=0;
+	mcp23017_emu.regs[MCP23x17_IODIRA]=0xFF;
+	mcp23017_emu.regs[MCP23x17_IODIRB]=0xFF;
+	mcp23017_emu.int_pending[0]=mcp23017_emu.int_pending[1]=0;
+	return 1;
+}
+
+struct wiringPiNodeStruct *wiringPiFindNode(int pin) {
+	if (mcp23017_emu_bit(pin)<0) return NULL;
+	return &mcp23017_emu.node;
+}
+
+//Drive the INT output of a bank => active while INTF has any bit set
+void mcp23017_emu_int(int bank) {
+	int pin=mcp23017_emu.int_pins[bank];
+	unsigned int status=mcp23017_emu.regs[MCP23x17_INTFA+bank]!=0;
+	if (pin<0 || pin>=GPIO_MAX || gpio[pin].status==status) return;
+	gpio[pin].status=status;
+	if (status) mcp23017_emu.int_pending[bank]=1;
+}
+
+//Register read, with the side effects of the real chip
+int mcp23017_emu_read(int reg) {
+	if (reg<0 || reg>=0x16) return 0;
+	int val=mcp23017_emu.regs[reg];
+	if ((reg>=MCP23x17_INTCAPA && reg<=MCP23x17_INTCAPB) || (reg>=MCP23x17_GPIOA && reg<=MCP23x17_GPIOB)) {
+		int bank=reg&0x01;
+		mcp23017_emu.regs[MCP23x17_INTFA+bank]=0;
+		mcp23017_emu_int(bank);
+	}
+	return val;
+}
+
+int wiringPiI2CReadReg8(int fd, int reg) {
+	return mcp23017_emu_read(reg);
+}
+
+int wiringPiI2CWriteReg8(int fd, int reg, int data) {
+	if (reg<0 || reg>=0x16) return -1;
+	//Read-only registers
+	if (reg>=MCP23x17_INTFA && reg<=MCP23x17_INTCAPB) return 0;
+	//IOCON is shared by both banks
+	if (reg==MCP23x17_IOCON || reg==MCP23x17_IOCONB) {
+		mcp23017_emu.regs[MCP23x17_IOCON]=mcp23017_emu.regs[MCP23x17_IOCONB]=data;
+		return 0;
+	}
+	mcp23017_emu.regs[reg]=data;
+	return 0;
+}
+
+int wiringPiI2CReadBlock(int fd, int reg, unsigned char *data, int n) {
+	int i;
+	for (i=0;i<n;i++) data[i]=mcp23017_emu_read(reg+i);
+	return n;
+}
+
+void mcp23017EmuSetIntPins(int pin_a, int pin_b) {
+	mcp23017_emu.int_pins[0]=pin_a;
+	mcp23017_emu.int_pins[1]=pin_b;
+}
+
+void mcp23017EmuSetPins(unsigned int pins) {
+	int bank;
+	for (bank=0;bank<2;bank++) {
+		unsigned char *regs=mcp23017_emu.regs;
+		unsigned char val=(pins>>(8*bank)) & regs[MCP23x17_IODIRA+bank];
+		unsigned char changed=val ^ regs[MCP23x17_GPIOA+bank];
+		//Interrupt-on-change or compare to DEFVAL
+		unsigned char intcon=regs[MCP23x17_INTCONA+bank];
+		unsigned char trigger=((changed & ~intcon) | ((val ^ regs[MCP23x17_DEFVALA+bank]) & intcon)) & regs[MCP23x17_GPINTENA+bank];
+		regs[MCP23x17_GPIOA+bank]=val;
+		//INTCAP keeps the first captured state until it's read
+		if (trigger && regs[MCP23x17_INTFA+bank]==0) {
+			regs[MCP23x17_INTFA+bank]=trigger;
+			regs[MCP23x17_INTCAPA+bank]=val;
+			mcp23017_emu_int(bank);
+		}
+	}
+	if (!mcp23017_emu.deferred) mcp23017EmuDeliverInts();
+}
+
+void mcp23017EmuSetDeferredInts(int deferred) {
+	mcp23017_emu.deferred=deferred;
+}
+
+void mcp23017EmuDeliverInts(void) {
+	int bank;
+	for (bank=0;bank<2;bank++) {
+		int pin=mcp23017_emu.int_pins[bank];
+		if (!mcp23017_emu.int_pending[bank]) continue;
+		mcp23017_emu.int_pending[bank]=0;
+		if (gpio[pin].isrfunc && (gpio[pin].isrmode==INT_EDGE_RISING || gpio[pin].isrmode==INT_EDGE_BOTH))
+			gpio[pin].isrfunc();
+	}
+}
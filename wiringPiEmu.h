@@ -88,6 +88,52 @@ extern "C" {
 
 	extern int  wiringPiISR         (int pin, int mode, void (*function)(void)) ;
 
+	// MCP23017 Emulation => I2C register file & interrupt outputs
+
+	#define MCP23x17_IODIRA		0x00
+	#define MCP23x17_IODIRB		0x01
+	#define MCP23x17_IPOLA		0x02
+	#define MCP23x17_IPOLB		0x03
+	#define MCP23x17_GPINTENA	0x04
+	#define MCP23x17_GPINTENB	0x05
+	#define MCP23x17_DEFVALA	0x06
+	#define MCP23x17_DEFVALB	0x07
+	#define MCP23x17_INTCONA	0x08
+	#define MCP23x17_INTCONB	0x09
+	#define MCP23x17_IOCON		0x0A
+	#define MCP23x17_IOCONB		0x0B
+	#define MCP23x17_GPPUA		0x0C
+	#define MCP23x17_GPPUB		0x0D
+	#define MCP23x17_INTFA		0x0E
+	#define MCP23x17_INTFB		0x0F
+	#define MCP23x17_INTCAPA	0x10
+	#define MCP23x17_INTCAPB	0x11
+	#define MCP23x17_GPIOA		0x12
+	#define MCP23x17_GPIOB		0x13
+	#define MCP23x17_OLATA		0x14
+	#define MCP23x17_OLATB		0x15
+
+	struct wiringPiNodeStruct {
+		int pinBase;
+		int pinMax;
+		int fd;
+	};
+
+	extern int  mcp23017Setup       (int pinBase, int i2cAddress) ;
+	extern struct wiringPiNodeStruct *wiringPiFindNode (int pin) ;
+	extern int  wiringPiI2CReadReg8 (int fd, int reg) ;
+	extern int  wiringPiI2CWriteReg8 (int fd, int reg, int data) ;
+	// Sequential read of n registers in one transfer (I2C_RDWR in the real library)
+	extern int  wiringPiI2CReadBlock (int fd, int reg, unsigned char *data, int n) ;
+
+	// GPIOs driven by the INTA/INTB outputs
+	extern void mcp23017EmuSetIntPins (int pin_a, int pin_b) ;
+	// Set the 16 input pins (bank B in the high byte) => latches INTF/INTCAP
+	extern void mcp23017EmuSetPins   (unsigned int pins) ;
+	// Deferred => interrupt handlers don't run until mcp23017EmuDeliverInts
+	extern void mcp23017EmuSetDeferredInts (int deferred) ;
+	extern void mcp23017EmuDeliverInts (void) ;
+
 	
 #ifdef __cplusplus
 }
@@ -32,7 +32,15 @@
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <stdatomic.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include <jack/ringbuffer.h>
@@ -40,70 +48,403 @@
 
 #include "zyncoder.h"
 
-#if defined(MCP23017_ENCODERS) && defined(HAVE_WIRINGPI_LIB)
+#if defined(MCP23017_ENCODERS)
 	// pins 100-115 are located on our mcp23017
 	#define MCP23017_BASE_PIN 100
+	#define MCP23017_I2C_ADDR 0x20
 	// interrupt pins for the mcp
 	#define MCP23017_INTA_PIN 27
 	#define MCP23017_INTB_PIN 25
-	#include <wiringPi.h>
-	#include <mcp23017.h>
-	#include <mcp23x0817.h>
+	#ifdef HAVE_WIRINGPI_LIB
+		#include <sys/ioctl.h>
+		#include <linux/i2c.h>
+		#include <linux/i2c-dev.h>
+		#include <wiringPi.h>
+		#include <mcp23017.h>
+		#include <mcp23x0817.h>
+	#else
+		#include "wiringPiEmu.h"
+	#endif
 	#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
 	#define bitSet(value, bit) ((value) |= (1UL << (bit)))
 	#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
 	#define bitWrite(value, bit, bitvalue) (bitvalue ? bitSet(value, bit) : bitClear(value, bit))
 #elif HAVE_WIRINGPI_LIB
 	#define MCP23008_BASE_PIN 100
+	#define HAVE_GPIO_CHARDEV
 	#include <wiringPi.h>
+	#include <wiringPiI2C.h>
 	#include <mcp23008.h>
+	#include <mcp23x0817.h>
 #else
 	#define MCP23008_BASE_PIN 100
+	#define HAVE_GPIO_CHARDEV
 	#include "wiringPiEmu.h"
 #endif
 
+#if defined(HAVE_GPIO_CHARDEV) && defined(__linux__)
+	#include <poll.h>
+	#include <sys/ioctl.h>
+	#include <linux/gpio.h>
+	//GPIO chardev v2 uAPI => Linux 5.10
+	#ifndef GPIO_V2_GET_LINE_IOCTL
+		#undef HAVE_GPIO_CHARDEV
+	#endif
+#else
+	#undef HAVE_GPIO_CHARDEV
+#endif
+
+//-----------------------------------------------------------------------------
+// Lock-free queues
+//-----------------------------------------------------------------------------
+//	Bounded multi-producer/single-consumer queue of fixed-size records.
+//	Every slot carries a sequence number (Vyukov's algorithm): producers
+//	claim a position with a CAS on "write" and publish the record by
+//	releasing the slot sequence, so concurrent writers never interleave
+//	their bytes. push/pop never block and never allocate memory.
+//-----------------------------------------------------------------------------
+
+struct zynqueue_slot_st {
+	atomic_uint seq;
+	uint8_t data[];
+};
+
+struct zynqueue_st {
+	unsigned int size_mask;
+	unsigned int item_size;
+	unsigned int slot_size;
+	uint8_t *slots;
+	_Alignas(64) atomic_uint write;
+	_Alignas(64) atomic_uint read;
+};
+
+#define ZYNQUEUE_SLOT(q,pos) ((struct zynqueue_slot_st *)((q)->slots+((pos) & (q)->size_mask)*(q)->slot_size))
+
+//Capacity must be a power of two. This is *NOT* realtime safe, do it before using the queue!
+int zynqueue_init(struct zynqueue_st *q, unsigned int capacity, unsigned int item_size) {
+	unsigned int i;
+	if (capacity==0 || (capacity & (capacity-1))!=0) {
+		fprintf (stderr, "Zyncoder: Queue capacity (%u) must be a power of two!\n",capacity);
+		return -1;
+	}
+	q->size_mask=capacity-1;
+	q->item_size=item_size;
+	q->slot_size=(sizeof(struct zynqueue_slot_st)+item_size+7) & ~7;
+	q->slots=calloc(capacity,q->slot_size);
+	if (q->slots==NULL) {
+		fprintf (stderr, "Zyncoder: Error allocating queue memory.\n");
+		return -1;
+	}
+	if (mlock(q->slots,capacity*q->slot_size)) {
+		fprintf (stderr, "Zyncoder: Error locking queue memory.\n");
+	}
+	for (i=0;i<capacity;i++) atomic_init(&ZYNQUEUE_SLOT(q,i)->seq,i);
+	atomic_init(&q->write,0);
+	atomic_init(&q->read,0);
+	return 0;
+}
+
+void zynqueue_free(struct zynqueue_st *q) {
+	if (q->slots) {
+		munlock(q->slots,(q->size_mask+1)*q->slot_size);
+		free(q->slots);
+		q->slots=NULL;
+	}
+}
+
+//Safe from any thread. Returns 0 on success, -1 if the queue is full.
+int zynqueue_push(struct zynqueue_st *q, const void *item) {
+	struct zynqueue_slot_st *slot;
+	unsigned int pos=atomic_load_explicit(&q->write,memory_order_relaxed);
+	while (1) {
+		slot=ZYNQUEUE_SLOT(q,pos);
+		int diff=(int)(atomic_load_explicit(&slot->seq,memory_order_acquire)-pos);
+		if (diff==0) {
+			if (atomic_compare_exchange_weak_explicit(&q->write,&pos,pos+1,memory_order_relaxed,memory_order_relaxed)) break;
+		} else if (diff<0) {
+			return -1;
+		} else {
+			pos=atomic_load_explicit(&q->write,memory_order_relaxed);
+		}
+	}
+	memcpy(slot->data,item,q->item_size);
+	atomic_store_explicit(&slot->seq,pos+1,memory_order_release);
+	return 0;
+}
+
+//Consumer only. Returns a pointer to the oldest record, or NULL if the queue is empty.
+void *zynqueue_peek(struct zynqueue_st *q) {
+	unsigned int pos=atomic_load_explicit(&q->read,memory_order_relaxed);
+	struct zynqueue_slot_st *slot=ZYNQUEUE_SLOT(q,pos);
+	if ((int)(atomic_load_explicit(&slot->seq,memory_order_acquire)-(pos+1))<0) return NULL;
+	return slot->data;
+}
+
+//Consumer only. Releases the record returned by zynqueue_peek.
+void zynqueue_advance(struct zynqueue_st *q) {
+	unsigned int pos=atomic_load_explicit(&q->read,memory_order_relaxed);
+	atomic_store_explicit(&ZYNQUEUE_SLOT(q,pos)->seq,pos+q->size_mask+1,memory_order_release);
+	atomic_store_explicit(&q->read,pos+1,memory_order_relaxed);
+}
+
+//Consumer only. Returns 1 if a record was copied to "item", 0 if the queue is empty.
+int zynqueue_pop(struct zynqueue_st *q, void *item) {
+	void *data=zynqueue_peek(q);
+	if (data==NULL) return 0;
+	memcpy(item,data,q->item_size);
+	zynqueue_advance(q);
+	return 1;
+}
+
+//Producer gate => a module can be shut down while ISR or API threads may still call into it.
+//Producers enter before touching the module state (queues, jack client...) and leave when
+//done. Closing waits until the last producer has left, so the state can be freed after it.
+struct zyngate_st {
+	atomic_int open;
+	atomic_int users;
+};
+
+//Returns 1 if the gate is open (leave it when done), 0 if closed.
+int zyngate_enter(struct zyngate_st *g) {
+	atomic_fetch_add(&g->users,1);
+	if (atomic_load(&g->open)) return 1;
+	atomic_fetch_sub(&g->users,1);
+	return 0;
+}
+
+void zyngate_leave(struct zyngate_st *g) {
+	atomic_fetch_sub(&g->users,1);
+}
+
+void zyngate_open(struct zyngate_st *g) {
+	atomic_store(&g->open,1);
+}
+
+//Returns 1 if the gate was open
+int zyngate_close(struct zyngate_st *g) {
+	if (!atomic_exchange(&g->open,0)) return 0;
+	while (atomic_load(&g->users)) usleep(100);
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+// RT-safe logging
+//-----------------------------------------------------------------------------
+//	Realtime code never calls fprintf: it increments an atomic counter and
+//	pushes a small record to zynlog_queue. The logger thread drains the
+//	queue and writes to stderr. When the queue is full, only the counter
+//	is incremented.
+//-----------------------------------------------------------------------------
+
+const char *zyncoder_error_messages[NUM_ZYNCODER_ERRORS]={
+	"Error writing jack midi output queue: FULL",
+	"Error writing jack midi output queue: BAD SIZE",
+	"Error staging jack midi output events: TOO MANY EVENTS",
+	"Error writing jack midi output events: BUFFER FULL",
+	"Error processing jack midi input events: TOO MANY EVENTS",
+	"Error getting jack port buffer (frames)",
+	"Error reading GPIO edge events: LOST (pin)",
+	"Error writing OSC changes queue: FULL (zyncoder)",
+	"Error reading MCP23008 switches: I2C (register)"
+};
+
+struct zynlog_entry_st {
+	int error;
+	int arg;
+};
+
+//Logger polling interval
+int zynlog_poll_us=100000;
+
+struct zynqueue_st zynlog_queue;
+atomic_uint zyncoder_error_counters[NUM_ZYNCODER_ERRORS];
+pthread_t zynlog_tid;
+atomic_int zynlog_running=0;
+//Producers may be ISR threads, that can't be stopped => the queue is freed only after they left
+struct zyngate_st zynlog_gate;
+
+void zynlog(enum zyncoder_error_enum error, int arg) {
+	struct zynlog_entry_st entry={ .error=error, .arg=arg };
+	atomic_fetch_add_explicit(&zyncoder_error_counters[error],1,memory_order_relaxed);
+	if (zyngate_enter(&zynlog_gate)) {
+		zynqueue_push(&zynlog_queue, &entry);
+		zyngate_leave(&zynlog_gate);
+	}
+}
+
+void * zynlog_thread(void *arg) {
+	struct zynlog_entry_st entry;
+	while (atomic_load(&zynlog_running)) {
+		while (zynqueue_pop(&zynlog_queue, &entry)) {
+			fprintf (stderr, "Zyncoder: %s (%d)\n", zyncoder_error_messages[entry.error], entry.arg);
+		}
+		usleep(zynlog_poll_us);
+	}
+	return NULL;
+}
+
+int init_zynlog() {
+	int i;
+	for (i=0;i<NUM_ZYNCODER_ERRORS;i++) atomic_init(&zyncoder_error_counters[i],0);
+	if (zynqueue_init(&zynlog_queue, 256, sizeof(struct zynlog_entry_st))) return -1;
+	atomic_store(&zynlog_running,1);
+	int err=pthread_create(&zynlog_tid, NULL, &zynlog_thread, NULL);
+	if (err != 0) {
+		atomic_store(&zynlog_running,0);
+		zynqueue_free(&zynlog_queue);
+		fprintf (stderr, "Zyncoder: Can't create logger thread :[%s]\n", strerror(err));
+		return -1;
+	}
+	zyngate_open(&zynlog_gate);
+	return 0;
+}
+
+void end_zynlog() {
+	if (!zyngate_close(&zynlog_gate)) return;
+	atomic_store(&zynlog_running,0);
+	pthread_join(zynlog_tid, NULL);
+	zynqueue_free(&zynlog_queue);
+}
+
+unsigned int get_zyncoder_error_count(int error) {
+	if (error<0 || error>=NUM_ZYNCODER_ERRORS) return 0;
+	return atomic_load_explicit(&zyncoder_error_counters[error],memory_order_relaxed);
+}
+
+void reset_zyncoder_error_counts() {
+	int i;
+	for (i=0;i<NUM_ZYNCODER_ERRORS;i++) atomic_store_explicit(&zyncoder_error_counters[i],0,memory_order_relaxed);
+}
+
 //-----------------------------------------------------------------------------
 // Library Initialization
 //-----------------------------------------------------------------------------
 
-//Switch Polling interval
-int poll_zynswitches_us=10000;
+//Expanded switches polling => fast after activity, backing off to slow when idle
+unsigned int poll_zynswitches_fast_us=1000;
+unsigned int poll_zynswitches_slow_us=20000;
+unsigned int poll_zynswitches_hold_us=250000;
+//Interrupt mode => the poll thread is only a watchdog, for a missed edge leaving INT stuck
+unsigned int poll_zynswitches_watchdog_us=1000000;
+//MCP23008 INT line => GPIO pin, -1 if not wired (polling)
+int zynswitches_int_pin=-1;
 
 pthread_t init_poll_zynswitches();
+int init_zyncoder_gpio();
+void end_zyncoder_gpio();
+void init_zynmidi_buffer();
 int init_zyncoder_osc(int osc_port);
 int end_zyncoder_osc();
 int init_zyncoder_midi(char *name);
 int end_zyncoder_midi();
 
+#ifndef MCP23017_ENCODERS
+//wiringPi ISRs don't take arguments => one trampoline per native GPIO pin,
+//generated up to 64 (ZYNCODER_GPIO_MAX_PINS), plus a table for lookup.
+#define ISR_TRAMPOLINE(func,i) void func##_isr_##i() { func(i); }
+#define ISR_TRAMPOLINES_10(func,d) \
+	ISR_TRAMPOLINE(func,d##0) ISR_TRAMPOLINE(func,d##1) ISR_TRAMPOLINE(func,d##2) ISR_TRAMPOLINE(func,d##3) \
+	ISR_TRAMPOLINE(func,d##4) ISR_TRAMPOLINE(func,d##5) ISR_TRAMPOLINE(func,d##6) ISR_TRAMPOLINE(func,d##7) \
+	ISR_TRAMPOLINE(func,d##8) ISR_TRAMPOLINE(func,d##9)
+#define ISR_REFS_10(func,d) \
+	func##_isr_##d##0, func##_isr_##d##1, func##_isr_##d##2, func##_isr_##d##3, func##_isr_##d##4, \
+	func##_isr_##d##5, func##_isr_##d##6, func##_isr_##d##7, func##_isr_##d##8, func##_isr_##d##9
+#define ISR_TRAMPOLINES(func) \
+	ISR_TRAMPOLINE(func,0) ISR_TRAMPOLINE(func,1) ISR_TRAMPOLINE(func,2) ISR_TRAMPOLINE(func,3) \
+	ISR_TRAMPOLINE(func,4) ISR_TRAMPOLINE(func,5) ISR_TRAMPOLINE(func,6) ISR_TRAMPOLINE(func,7) \
+	ISR_TRAMPOLINE(func,8) ISR_TRAMPOLINE(func,9) \
+	ISR_TRAMPOLINES_10(func,1) ISR_TRAMPOLINES_10(func,2) ISR_TRAMPOLINES_10(func,3) \
+	ISR_TRAMPOLINES_10(func,4) ISR_TRAMPOLINES_10(func,5) \
+	ISR_TRAMPOLINE(func,60) ISR_TRAMPOLINE(func,61) ISR_TRAMPOLINE(func,62) ISR_TRAMPOLINE(func,63) \
+	void (*func##_isrs[64])(void)={ \
+		func##_isr_0, func##_isr_1, func##_isr_2, func##_isr_3, func##_isr_4, \
+		func##_isr_5, func##_isr_6, func##_isr_7, func##_isr_8, func##_isr_9, \
+		ISR_REFS_10(func,1), ISR_REFS_10(func,2), ISR_REFS_10(func,3), \
+		ISR_REFS_10(func,4), ISR_REFS_10(func,5), \
+		func##_isr_60, func##_isr_61, func##_isr_62, func##_isr_63 \
+	};
+#if ZYNCODER_GPIO_MAX_PINS>64
+#error "ISR trampolines are generated for 64 GPIO pins at most"
+#endif
+#endif
+
 #ifdef MCP23017_ENCODERS
 // wiringpi node structure for direct access to the mcp23017
 struct wiringPiNodeStruct *mcp23017_node;
 
-// two ISR routines for the two banks
-void mcp23017_bank_ISR(uint8_t bank);
-void mcp23017_bankA_ISR() { mcp23017_bank_ISR(0); }
-void mcp23017_bankB_ISR() { mcp23017_bank_ISR(1); }
-void (*mcp23017_bank_ISRs[2])={
-	mcp23017_bankA_ISR,
-	mcp23017_bankB_ISR
-};
+// one ISR routine for both banks => both are read in the same transfer
+void mcp23017_ISR();
+void update_mcp23017_dispatch();
 
 unsigned int int_to_int(unsigned int k) {
 	return (k == 0 || k == 1 ? k : ((k % 2) + 10 * int_to_int(k / 2)));
 }
 #endif
 
+//Registry => hot state arrays are cache line aligned, cold config is apart
+int registry_num_zyncoders=8;
+int registry_num_zynswitches=8;
+
+int set_zyncoder_registry_size(int ncoders, int nswitches) {
+	if (zyncoders!=NULL) {
+		fprintf (stderr, "Zyncoder: Registry size must be set before initializing the library!\n");
+		return -1;
+	}
+	if (ncoders<1 || ncoders>MAX_NUM_ZYNCODERS || nswitches<1 || nswitches>MAX_NUM_ZYNSWITCHES) {
+		fprintf (stderr, "Zyncoder: Registry size (%d, %d) is out of range!\n", ncoders, nswitches);
+		return -1;
+	}
+	registry_num_zyncoders=ncoders;
+	registry_num_zynswitches=nswitches;
+	return 0;
+}
+
+int init_zyncoder_registry() {
+	if (zyncoders!=NULL) return 0;
+	//Globals are set only when everything is allocated => a failed init can be retried
+	struct zyncoder_st *zcs=NULL;
+	struct zynswitch_st *zss=NULL;
+	struct zyncoder_config_st *zccs=NULL;
+	if (posix_memalign((void **)&zcs, 64, registry_num_zyncoders*sizeof(struct zyncoder_st)) ||
+		posix_memalign((void **)&zss, 64, registry_num_zynswitches*sizeof(struct zynswitch_st)) ||
+		(zccs=calloc(registry_num_zyncoders, sizeof(struct zyncoder_config_st)))==NULL) {
+		fprintf (stderr, "Zyncoder: Can't allocate zyncoders registry!\n");
+		free(zcs);
+		free(zss);
+		return -1;
+	}
+	memset(zcs,0,registry_num_zyncoders*sizeof(struct zyncoder_st));
+	memset(zss,0,registry_num_zynswitches*sizeof(struct zynswitch_st));
+	zyncoders_config=zccs;
+	zynswitches=zss;
+	zyncoders=zcs;
+	num_zyncoders=registry_num_zyncoders;
+	num_zynswitches=registry_num_zynswitches;
+	return 0;
+}
+
 int init_zyncoder(int osc_port) {
 	int i,j;
-	for (i=0;i<MAX_NUM_ZYNSWITCHES;i++) zynswitches[i].enabled=0;
-	for (i=0;i<MAX_NUM_ZYNCODERS;i++) {
+	if (init_zyncoder_registry()) return -1;
+	for (i=0;i<num_zynswitches;i++) zynswitches[i].enabled=0;
+	for (i=0;i<num_zyncoders;i++) {
 		zyncoders[i].enabled=0;
+		zyncoders[i].step_mode=ZYNCODER_QUARTER_STEP;
 		for (j=0;j<ZYNCODER_TICKS_PER_RETENT;j++) zyncoders[i].dtus[j]=0;
+		zyncoders[i].dtus_index=0;
+		zyncoders[i].dtus_sum=0;
+		zyncoders[i].accel_frac=0;
+		setup_zyncoder_accel(i,0,0,NULL,NULL);
+	}
+	for (i=0;i<16;i++) {
+		for (j=0;j<128;j++) zyncoder_midi_ctrl_map[i][j]=0;
 	}
-	for (i=0;i<ZYNMIDI_BUFFER_SIZE;i++) zynmidi_buffer[i]=0;
-	zynmidi_buffer_read=zynmidi_buffer_write=0;
+	init_zynmidi_buffer();
 	init_midi_filter();
 	wiringPiSetup();
+#ifndef MCP23017_ENCODERS
+	if (init_zyncoder_gpio()) return -1;
+#endif
 #ifdef MCP23017_ENCODERS
 	uint8_t reg;
 
@@ -136,7 +477,9 @@ int init_zyncoder(int osc_port) {
 
 	// configure the interrupt behavior for bank A
 	uint8_t ioconf_value = wiringPiI2CReadReg8(mcp23017_node->fd, MCP23x17_IOCON);
+	bitWrite(ioconf_value, 7, 0);	// registers are interleaved (A/B pairs)
 	bitWrite(ioconf_value, 6, 0);	// banks are not mirrored
+	bitWrite(ioconf_value, 5, 0);	// sequential reads are enabled
 	bitWrite(ioconf_value, 2, 0);	// interrupt pin is not floating
 	bitWrite(ioconf_value, 1, 1);	// interrupt is signaled by high
 	wiringPiI2CWriteReg8(mcp23017_node->fd, MCP23x17_IOCON, ioconf_value);
@@ -154,17 +497,28 @@ int init_zyncoder(int osc_port) {
 	wiringPiI2CWriteReg8(mcp23017_node->fd, MCP23x17_GPINTENA, reg);
 	wiringPiI2CWriteReg8(mcp23017_node->fd, MCP23x17_GPINTENB, reg);
 
+	// build the (empty) bank dispatch tables before enabling the ISRs
+	update_mcp23017_dispatch();
+
 	// pi ISRs for the 23017
+#ifndef HAVE_WIRINGPI_LIB
+	mcp23017EmuSetIntPins(MCP23017_INTA_PIN, MCP23017_INTB_PIN);
+#endif
 	// bank A
-	wiringPiISR(MCP23017_INTA_PIN, INT_EDGE_RISING, mcp23017_bank_ISRs[0]);
+	wiringPiISR(MCP23017_INTA_PIN, INT_EDGE_RISING, mcp23017_ISR);
 	// bank B
-	wiringPiISR(MCP23017_INTB_PIN, INT_EDGE_RISING, mcp23017_bank_ISRs[1]);
+	wiringPiISR(MCP23017_INTB_PIN, INT_EDGE_RISING, mcp23017_ISR);
 
 #ifdef DEBUG
 	printf("mcp23017 initialized\n");
 #endif
 #else
 	mcp23008Setup (100, 0x20);
+#ifdef HAVE_WIRINGPI_LIB
+	if (wiringPiFindNode(MCP23008_BASE_PIN)==NULL) {
+		fprintf (stderr, "Zyncoder: Error setting up MCP23008 => expanded switches are disabled.\n");
+	}
+#endif
 	init_poll_zynswitches();
 #endif
 	init_zyncoder_osc(osc_port);
@@ -172,6 +526,9 @@ int init_zyncoder(int osc_port) {
 }
 
 int end_zyncoder() {
+#ifndef MCP23017_ENCODERS
+	end_zyncoder_gpio();
+#endif
 	end_zyncoder_osc();
 	return end_zyncoder_midi();
 }
@@ -180,20 +537,305 @@ int end_zyncoder() {
 // OSC Message processing
 //-----------------------------------------------------------------------------
 
-lo_address osc_lo_addr;
 char osc_port_str[8];
+//Connected UDP socket => no address lookup & routing per packet
+int osc_sock=-1;
+
+//OSC output => ISRs only flag the changed zyncoders. The sender thread wakes up on the first
+//change and sends all the flagged zyncoders, with their latest values, in a single bundle.
+//Then it sleeps osc_send_interval_us, so the bundle rate is bounded.
+_Atomic(zyncoder_mask_t) zyncoders_osc_dirty;
+unsigned int osc_send_interval_us=10000;
+sem_t osc_send_sem;
+pthread_t osc_send_tid;
+volatile int osc_send_running=0;
+
+//Preserialize the zyncoder OSC message => padded path, type tags & int32 argument.
+//Sending copies it and only patches the type tag (T/F) or the argument bytes. Messages are
+//rewritten by setup_zyncoder while the sender thread copies them => serialized by a mutex.
+pthread_mutex_t osc_msg_lock=PTHREAD_MUTEX_INITIALIZER;
+
+void update_zyncoder_osc_msg(uint8_t i) {
+	struct zyncoder_config_st *config = zyncoders_config + i;
+	int len=strlen(config->osc_path);
+	pthread_mutex_lock(&osc_msg_lock);
+	if (len==0) {
+		config->osc_msg_len=0;
+		pthread_mutex_unlock(&osc_msg_lock);
+		return;
+	}
+	memset(config->osc_msg,0,sizeof(config->osc_msg));
+	memcpy(config->osc_msg,config->osc_path,len);
+	config->osc_tag_offset=(len+4) & ~0x03;
+	config->osc_msg[config->osc_tag_offset]=',';
+	config->osc_msg[config->osc_tag_offset+1]='i';
+	config->osc_msg_len=config->osc_tag_offset+8;
+	pthread_mutex_unlock(&osc_msg_lock);
+}
+
+//Copy the message into buf, with the current value patched in. Returns its length, 0 if the
+//zyncoder has no OSC path. Called with osc_msg_lock held.
+int copy_zyncoder_osc_msg(uint8_t i, uint8_t *buf) {
+	struct zyncoder_st *zyncoder = zyncoders + i;
+	struct zyncoder_config_st *config = zyncoders_config + i;
+	if (config->osc_msg_len==0) return 0;
+	memcpy(buf,config->osc_msg,config->osc_tag_offset+4);
+	uint8_t *tags=buf+config->osc_tag_offset;
+	if (zyncoder->step >= 8) {
+		tags[1]=(zyncoder->value>=64) ? 'T' : 'F';
+		return config->osc_tag_offset+4;
+	}
+	uint32_t value=htonl(zyncoder->value);
+	memcpy(tags+4,&value,4);
+	return config->osc_tag_offset+8;
+}
+
+int send_zyncoder_osc(uint8_t i) {
+	uint8_t msg[sizeof(((struct zyncoder_config_st *)0)->osc_msg)];
+	if (osc_sock<0 || i>=num_zyncoders) return -1;
+	pthread_mutex_lock(&osc_msg_lock);
+	int len=copy_zyncoder_osc_msg(i,msg);
+	pthread_mutex_unlock(&osc_msg_lock);
+	if (len==0) return -1;
+	return send(osc_sock,msg,len,MSG_DONTWAIT)==len ? 0 : -1;
+}
+
+//Bundle => "#bundle", immediate time tag & (size, message) elements. Full bundles are
+//flushed, so they fit in a datagram.
+#define OSC_BUNDLE_MAX 8192
+uint8_t osc_bundle_buffer[OSC_BUNDLE_MAX];
+const uint8_t osc_bundle_header[16]={ '#','b','u','n','d','l','e',0, 0,0,0,0, 0,0,0,1 };
+
+void send_zyncoders_osc(zyncoder_mask_t dirty) {
+	int i, len, n=0, pos=sizeof(osc_bundle_header);
+	//Single message => no bundle
+	if ((dirty & (dirty-1))==0) {
+		send_zyncoder_osc(__builtin_ctzll(dirty));
+		return;
+	}
+	memcpy(osc_bundle_buffer,osc_bundle_header,sizeof(osc_bundle_header));
+	pthread_mutex_lock(&osc_msg_lock);
+	for (i=0;dirty;i++,dirty>>=1) {
+		if (!(dirty & 0x1)) continue;
+		struct zyncoder_st *zyncoder = zyncoders + i;
+		struct zyncoder_config_st *config = zyncoders_config + i;
+		if (zyncoder->enabled==0 || config->osc_msg_len==0) continue;
+		if (pos+4+config->osc_msg_len>OSC_BUNDLE_MAX) {
+			send(osc_sock,osc_bundle_buffer,pos,MSG_DONTWAIT);
+			pos=sizeof(osc_bundle_header);
+			n=0;
+		}
+		//Messages are copied straight into the bundle
+		len=copy_zyncoder_osc_msg(i,osc_bundle_buffer+pos+4);
+		uint32_t size=htonl(len);
+		memcpy(osc_bundle_buffer+pos,&size,4);
+		pos+=4+len;
+		n++;
+		//printf("SEND OSC %s => %d\n",config->osc_path,zyncoder->value);
+	}
+	pthread_mutex_unlock(&osc_msg_lock);
+	if (n>0) send(osc_sock,osc_bundle_buffer,pos,MSG_DONTWAIT);
+}
+
+void * osc_send_thread(void *arg) {
+	while (1) {
+		if (sem_wait(&osc_send_sem)!=0) continue;
+		if (!osc_send_running) break;
+		zyncoder_mask_t dirty=atomic_exchange(&zyncoders_osc_dirty,0);
+		if (dirty) {
+			send_zyncoders_osc(dirty);
+			usleep(osc_send_interval_us);
+		}
+	}
+	return NULL;
+}
+
+//Flag a zyncoder for the OSC sender => lock-free, safe from ISRs
+void queue_zyncoder_osc(uint8_t i) {
+	zyncoder_mask_t prev=atomic_fetch_or(&zyncoders_osc_dirty,(zyncoder_mask_t)1 << i);
+	if (prev==0) sem_post(&osc_send_sem);
+}
+
+void set_zyncoder_osc_interval(unsigned int interval_us) {
+	osc_send_interval_us=interval_us;
+}
 
 int init_zyncoder_osc(int osc_port) {
 	if (osc_port) {
 		sprintf(osc_port_str,"%d",osc_port);
 		//printf("OSC PORT: %s\n",osc_port_str);
-		osc_lo_addr=lo_address_new(NULL,osc_port_str);
+		struct addrinfo hints, *res, *ai;
+		memset(&hints,0,sizeof(hints));
+		hints.ai_family=AF_UNSPEC;
+		hints.ai_socktype=SOCK_DGRAM;
+		if (getaddrinfo("localhost",osc_port_str,&hints,&res)!=0) {
+			fprintf (stderr, "Zyncoder: Can't resolve OSC address localhost:%s\n", osc_port_str);
+			return -1;
+		}
+		for (ai=res;ai!=NULL;ai=ai->ai_next) {
+			osc_sock=socket(ai->ai_family,ai->ai_socktype | SOCK_CLOEXEC,ai->ai_protocol);
+			if (osc_sock<0) continue;
+			if (connect(osc_sock,ai->ai_addr,ai->ai_addrlen)==0) break;
+			close(osc_sock);
+			osc_sock=-1;
+		}
+		freeaddrinfo(res);
+		if (osc_sock<0) {
+			fprintf (stderr, "Zyncoder: Can't connect OSC socket to localhost:%s\n", osc_port_str);
+			return -1;
+		}
+		atomic_init(&zyncoders_osc_dirty,0);
+		if (sem_init(&osc_send_sem,0,0)!=0) return -1;
+		osc_send_running=1;
+		int err=pthread_create(&osc_send_tid, NULL, &osc_send_thread, NULL);
+		if (err != 0) {
+			osc_send_running=0;
+			fprintf (stderr, "Zyncoder: Can't create OSC sender thread :[%s]\n", strerror(err));
+			return -1;
+		}
 		return 0;
 	}
 	return -1;
 }
 
+//-----------------------------------------------------------------------------
+// OSC Server => engine feedback is applied to the zyncoders directly
+//-----------------------------------------------------------------------------
+
+//OSC path => zyncoder index, open addressing with linear probing. Paths can be shared,
+//so lookups apply to every match.
+#define OSC_PATH_HASH_SIZE (2*MAX_NUM_ZYNCODERS)
+//Masked with SIZE-1 => power of two. Probing stops at an empty slot => larger than the
+//zyncoders count, that can't exceed MAX_NUM_ZYNCODERS.
+#if (OSC_PATH_HASH_SIZE & (OSC_PATH_HASH_SIZE-1))!=0 || OSC_PATH_HASH_SIZE<=MAX_NUM_ZYNCODERS
+#error "OSC_PATH_HASH_SIZE must be a power of two, larger than MAX_NUM_ZYNCODERS"
+#endif
+struct osc_path_hash_st {
+	uint32_t hash;
+	int16_t zyncoder;		// -1 => empty
+};
+struct osc_path_hash_st osc_path_hash[OSC_PATH_HASH_SIZE];
+pthread_mutex_t osc_path_hash_lock=PTHREAD_MUTEX_INITIALIZER;
+
+lo_server_thread osc_server=NULL;
+struct zynqueue_st osc_changes_queue;
+//The UI thread reading the changes queue => it's freed only after the reader left
+struct zyngate_st osc_changes_gate;
+
+struct osc_change_st {
+	uint8_t zyncoder;
+	unsigned int value;
+};
+
+//FNV-1a
+uint32_t get_osc_path_hash(const char *path) {
+	uint32_t hash=2166136261u;
+	while (*path) {
+		hash^=(uint8_t)*path++;
+		hash*=16777619u;
+	}
+	return hash;
+}
+
+void update_osc_path_hash() {
+	int i, j;
+	pthread_mutex_lock(&osc_path_hash_lock);
+	for (j=0;j<OSC_PATH_HASH_SIZE;j++) osc_path_hash[j].zyncoder=-1;
+	for (i=0;i<num_zyncoders;i++) {
+		if (zyncoders[i].enabled==0 || zyncoders_config[i].osc_path[0]==0) continue;
+		uint32_t hash=get_osc_path_hash(zyncoders_config[i].osc_path);
+		j=hash & (OSC_PATH_HASH_SIZE-1);
+		while (osc_path_hash[j].zyncoder>=0) j=(j+1) & (OSC_PATH_HASH_SIZE-1);
+		osc_path_hash[j].hash=hash;
+		osc_path_hash[j].zyncoder=i;
+	}
+	pthread_mutex_unlock(&osc_path_hash_lock);
+}
+
+//Apply an incoming value to the zyncoders bound to path. Returns the number of zyncoders.
+int set_osc_path_value(const char *path, unsigned int value) {
+	int j, n=0;
+	uint32_t hash=get_osc_path_hash(path);
+	pthread_mutex_lock(&osc_path_hash_lock);
+	for (j=hash & (OSC_PATH_HASH_SIZE-1); osc_path_hash[j].zyncoder>=0; j=(j+1) & (OSC_PATH_HASH_SIZE-1)) {
+		uint8_t i=osc_path_hash[j].zyncoder;
+		if (osc_path_hash[j].hash!=hash || strcmp(zyncoders_config[i].osc_path,path)!=0) continue;
+		//Not sent back => it comes from the engine
+		set_value_zyncoder(i,value,0);
+		struct osc_change_st change={ .zyncoder=i, .value=zyncoders[i].value };
+		if (zynqueue_push(&osc_changes_queue,&change)) zynlog(ZYNCODER_ERR_OSC_CHANGES_FULL, i);
+		n++;
+	}
+	pthread_mutex_unlock(&osc_path_hash_lock);
+	return n;
+}
+
+int osc_server_handler(const char *path, const char *types, lo_arg **argv, int argc, lo_message msg, void *data) {
+	unsigned int value;
+	if (argc<1) return 1;
+	switch (types[0]) {
+		case 'i': value=(argv[0]->i<0) ? 0 : argv[0]->i; break;
+		case 'f': value=(argv[0]->f<0) ? 0 : (unsigned int)(argv[0]->f+0.5f); break;
+		case 'T': value=127; break;
+		case 'F': value=0; break;
+		default: return 1;
+	}
+	return set_osc_path_value(path,value)>0 ? 0 : 1;
+}
+
+void osc_server_error(int num, const char *msg, const char *path) {
+	fprintf (stderr, "Zyncoder: OSC server error %d in path %s: %s\n", num, path, msg);
+}
+
+int init_zyncoder_osc_server(int port) {
+	char port_str[8];
+	if (osc_server!=NULL) return 0;
+	if (zynqueue_init(&osc_changes_queue, 256, sizeof(struct osc_change_st))) return -1;
+	update_osc_path_hash();
+	sprintf(port_str,"%d",port);
+	osc_server=lo_server_thread_new(port_str,osc_server_error);
+	if (osc_server==NULL) {
+		fprintf (stderr, "Zyncoder: Can't create OSC server on port %s\n", port_str);
+		zynqueue_free(&osc_changes_queue);
+		return -1;
+	}
+	//Any path & types => matched by the hash table
+	lo_server_thread_add_method(osc_server,NULL,NULL,osc_server_handler,NULL);
+	lo_server_thread_start(osc_server);
+	zyngate_open(&osc_changes_gate);
+	return 0;
+}
+
+int end_zyncoder_osc_server() {
+	if (osc_server==NULL) return 0;
+	zyngate_close(&osc_changes_gate);
+	lo_server_thread_stop(osc_server);
+	lo_server_thread_free(osc_server);
+	osc_server=NULL;
+	zynqueue_free(&osc_changes_queue);
+	return 0;
+}
+
+int read_zyncoder_osc_change(uint8_t *i, unsigned int *value) {
+	struct osc_change_st change;
+	if (!zyngate_enter(&osc_changes_gate)) return 0;
+	int res=zynqueue_pop(&osc_changes_queue,&change);
+	zyngate_leave(&osc_changes_gate);
+	if (!res) return 0;
+	*i=change.zyncoder;
+	*value=change.value;
+	return 1;
+}
+
 int end_zyncoder_osc() {
+	end_zyncoder_osc_server();
+	if (!osc_send_running) return 0;
+	osc_send_running=0;
+	sem_post(&osc_send_sem);
+	pthread_join(osc_send_tid, NULL);
+	sem_destroy(&osc_send_sem);
+	close(osc_sock);
+	osc_sock=-1;
 	return 0;
 }
 
@@ -201,59 +843,150 @@ int end_zyncoder_osc() {
 // MIDI filter management
 //-----------------------------------------------------------------------------
 
+void write_midi_filter_event_map(struct midi_filter_st *mf, uint8_t ti, uint8_t chan_from, uint8_t num_from,
+																 enum midi_event_type_enum type_to, uint8_t chan_to, uint8_t num_to);
+void update_midi_filter_pristine(struct midi_filter_st *mf);
+void update_midi_filter_pristine_chan(struct midi_filter_st *mf, uint8_t ti, uint8_t chan);
+void update_midi_filter_cc_pred(struct midi_filter_st *mf);
+
+//Double-buffered filter: jack_process reads midi_filter_active once per cycle and
+//publishes the copy it's using in midi_filter_rt_used (hazard pointer).
+//Preloaded presets can be published too, so the active copy is not always a buffer.
+struct midi_filter_st midi_filter_buffers[2];
+_Atomic(struct midi_filter_st *) midi_filter_active;
+_Atomic(struct midi_filter_st *) midi_filter_rt_used;
+//Completed jack cycles => grace period for releasing presets
+atomic_uint midi_filter_cycles;
+int midi_filter_transaction;
+
 void init_midi_filter() {
 	int i,j,k;
-	midi_filter.master_chan=-1;
-	midi_filter.tuning_pitchbend=-1;
+	atomic_init(&midi_filter_rt_used,NULL);
+	atomic_init(&midi_filter_active,&midi_filter_buffers[0]);
+	atomic_init(&midi_filter_cycles,0);
+	midi_filter_transaction=0;
+	midi_filter=&midi_filter_buffers[0];
+	midi_filter->master_chan=-1;
+	midi_filter->tuning_pitchbend=-1;
 	for (i=0;i<16;i++) {
-		midi_filter.transpose[i]=0;
+		midi_filter->transpose[i]=0;
 	}
 	for (i=0;i<8;i++) {
 		for (j=0;j<16;j++) {
 			for (k=0;k<128;k++) {
-				midi_filter.event_map[i][j][k].type=THRU_EVENT;
-				midi_filter.event_map[i][j][k].chan=j;
-				midi_filter.event_map[i][j][k].num=k;
+				write_midi_filter_event_map(midi_filter,i,j,k,THRU_EVENT,j,k);
 			}
 		}
 	}
+	update_midi_filter_pristine(midi_filter);
+	update_midi_filter_cc_pred(midi_filter);
 	for (i=0;i<16;i++) {
 		for (j=0;j<128;j++) {
-			midi_filter.last_ctrl_val[i][j]=0;
+			midi_filter_state.last_ctrl_val[i][j]=0;
 		}
 	}
 	for (i=0;i<16;i++) {
-		midi_filter.last_pb_val[i]=8192;
+		midi_filter_state.last_pb_val[i]=8192;
 	}
 	
 }
 
+//Called by jack_process at the start of every cycle
+struct midi_filter_st *acquire_midi_filter() {
+	struct midi_filter_st *mf;
+	do {
+		mf=atomic_load(&midi_filter_active);
+		atomic_store(&midi_filter_rt_used,mf);
+	} while (mf!=atomic_load(&midi_filter_active));
+	return mf;
+}
+
+//Called by jack_process at the end of every cycle
+void release_midi_filter() {
+	atomic_store(&midi_filter_rt_used,NULL);
+	atomic_fetch_add(&midi_filter_cycles,1);
+}
+
+int begin_midi_filter_transaction() {
+	if (midi_filter_transaction) {
+		fprintf (stderr, "Zyncoder: MIDI filter transaction already started!\n");
+		return 0;
+	}
+	struct midi_filter_st *active=atomic_load(&midi_filter_active);
+	//Use the buffer not published. If a preset is active, avoid the one used by jack thread.
+	struct midi_filter_st *shadow=&midi_filter_buffers[0];
+	if (active==shadow || (active!=&midi_filter_buffers[1] && atomic_load(&midi_filter_rt_used)==shadow)) shadow=&midi_filter_buffers[1];
+	//Reclaim the previous copy => wait until jack thread is not using it anymore
+	while (atomic_load(&midi_filter_rt_used)==shadow) usleep(100);
+	memcpy(shadow,active,sizeof(struct midi_filter_st));
+	midi_filter=shadow;
+	midi_filter_transaction=1;
+	return 1;
+}
+
+int commit_midi_filter_transaction() {
+	if (!midi_filter_transaction) {
+		fprintf (stderr, "Zyncoder: MIDI filter transaction not started!\n");
+		return 0;
+	}
+	//Publish the shadow copy => jack_process will use it from the next cycle
+	atomic_store(&midi_filter_active,midi_filter);
+	midi_filter_transaction=0;
+	return 1;
+}
+
+void abort_midi_filter_transaction() {
+	midi_filter_transaction=0;
+	midi_filter=atomic_load(&midi_filter_active);
+}
+
+//Filter copy for reading from the UI side => outside a transaction, the active one.
+//It can change under our feet when jack thread switches presets.
+struct midi_filter_st *view_midi_filter() {
+	if (!midi_filter_transaction) midi_filter=atomic_load(&midi_filter_active);
+	return midi_filter;
+}
+
+//Filter copy for editing from the UI side. Presets are read-only => when one is
+//active, a copy is published first and edited in place.
+struct midi_filter_st *edit_midi_filter() {
+	view_midi_filter();
+	if (midi_filter!=&midi_filter_buffers[0] && midi_filter!=&midi_filter_buffers[1]) {
+		begin_midi_filter_transaction();
+		commit_midi_filter_transaction();
+	}
+	return midi_filter;
+}
+
 void set_midi_master_chan(int chan) {
+	struct midi_filter_st *mf=edit_midi_filter();
 	if (chan>15 || chan<0) {
 		fprintf (stderr, "Zyncoder: MIDI Master channel (%d) is out of range!\n",chan);
 		return;
 	}
-	midi_filter.master_chan=chan;
+	mf->master_chan=chan;
 }
 
 //MIDI pitch-bending fine-tuning
 
 void set_midi_filter_tuning_freq(int freq) {
+	struct midi_filter_st *mf=edit_midi_filter();
 	double pb=6*log((double)freq/440.0)/log(2.0);
 	if (pb<1.0 && pb>-1.0) {
-		midi_filter.tuning_pitchbend=((int)(8192.0*(1.0+pb)))&0x3FFF;
-		fprintf (stdout, "Zyncoder: MIDI tuning frequency set to %d Hz (%d)\n",freq,midi_filter.tuning_pitchbend);
+		mf->tuning_pitchbend=((int)(8192.0*(1.0+pb)))&0x3FFF;
+		update_midi_filter_pristine(mf);
+		fprintf (stdout, "Zyncoder: MIDI tuning frequency set to %d Hz (%d)\n",freq,mf->tuning_pitchbend);
 	} else {
 		fprintf (stderr, "Zyncoder: MIDI tuning frequency out of range!\n");
 	}
 }
 
 int get_midi_filter_tuning_pitchbend() {
-	return midi_filter.tuning_pitchbend;
+	return view_midi_filter()->tuning_pitchbend;
 }
 
-int get_tuned_pitchbend(int pb) {
-	int tpb=midi_filter.tuning_pitchbend+pb-8192;
+int get_tuned_pitchbend(struct midi_filter_st *mf, int pb) {
+	int tpb=mf->tuning_pitchbend+pb-8192;
 	if (tpb<0) tpb=0;
 	else if (tpb>16383) tpb=16383;
 	return tpb;
@@ -262,6 +995,7 @@ int get_tuned_pitchbend(int pb) {
 //MIDI transposing
 
 void set_midi_filter_transpose(uint8_t chan, int offset) {
+	struct midi_filter_st *mf=edit_midi_filter();
 	if (chan>15) {
 		fprintf (stderr, "Zyncoder: MIDI Transpose channel (%d) is out of range!\n",chan);
 		return;
@@ -270,19 +1004,92 @@ void set_midi_filter_transpose(uint8_t chan, int offset) {
 		fprintf (stderr, "Zyncoder: MIDI Transpose offset (%d) is out of range!\n",offset);
 		return;
 	}
-	midi_filter.transpose[chan]=offset;
+	mf->transpose[chan]=offset;
+	update_midi_filter_pristine_chan(mf,NOTE_OFF & 0x7,chan);
+	update_midi_filter_pristine_chan(mf,NOTE_ON & 0x7,chan);
 }
 
 int get_midi_filter_transpose(uint8_t chan) {
+	struct midi_filter_st *mf=view_midi_filter();
 	if (chan>15) {
 		fprintf (stderr, "Zyncoder: MIDI Transpose channel (%d) is out of range!\n",chan);
 		return 0;
 	}
-	return midi_filter.transpose[chan];
+	return mf->transpose[chan];
 }
 
 //Core MIDI filter functions
 
+//Every change to the event map goes through here, so both representations are kept in sync
+void write_midi_filter_event_map(struct midi_filter_st *mf, uint8_t ti, uint8_t chan_from, uint8_t num_from,
+																 enum midi_event_type_enum type_to, uint8_t chan_to, uint8_t num_to) {
+	struct midi_event_st *event_map=&mf->event_map[ti][chan_from][num_from];
+	if (event_map->type!=THRU_EVENT) mf->event_map_count[ti][chan_from]--;
+	if (type_to!=THRU_EVENT) mf->event_map_count[ti][chan_from]++;
+	if (ti==(CTRL_CHANGE & 0x7)) {
+		uint16_t from=(chan_from << 7) | num_from;
+		//Old destiny loses an arrow => its predecessor is unknown if it was this node and others remain
+		uint8_t c=event_map->chan & 0xF, n=event_map->num & 0x7F;
+		if (mf->cc_pred_count[c][n]>0) mf->cc_pred_count[c][n]--;
+		if (mf->cc_pred[c][n]==from) mf->cc_pred[c][n]=mf->cc_pred_count[c][n] ? MF_NO_PRED : from;
+		//New destiny gets an arrow from this node
+		mf->cc_pred_count[chan_to][num_to]++;
+		mf->cc_pred[chan_to][num_to]=from;
+	}
+	event_map->type=type_to;
+	event_map->chan=chan_to;
+	event_map->num=num_to;
+	mf->event_map_packed[ti][chan_from][num_from]=MF_PACK_EVENT(type_to,chan_to,num_to);
+	update_midi_filter_pristine_chan(mf,ti,chan_from);
+}
+
+//Pristine state => events of type "ti" on channel "chan" are forwarded untouched
+void update_midi_filter_pristine_chan(struct midi_filter_st *mf, uint8_t ti, uint8_t chan) {
+	int pristine=(mf->event_map_count[ti][chan]==0);
+	if ((ti==(NOTE_OFF & 0x7) || ti==(NOTE_ON & 0x7)) && mf->transpose[chan]!=0) pristine=0;
+	if ((ti==(NOTE_ON & 0x7) || ti==(PITCH_BENDING & 0x7)) && mf->tuning_pitchbend>=0) pristine=0;
+	if (pristine) mf->pristine_chans[ti]|=(1 << chan);
+	else mf->pristine_chans[ti]&=~(1 << chan);
+
+	int i;
+	mf->pristine=1;
+	for (i=0;i<8;i++) {
+		if (mf->pristine_chans[i]!=0xFFFF) mf->pristine=0;
+	}
+}
+
+//Recalculate the full pristine state from scratch
+void update_midi_filter_pristine(struct midi_filter_st *mf) {
+	int i,j,k;
+	for (i=0;i<8;i++) {
+		for (j=0;j<16;j++) {
+			mf->event_map_count[i][j]=0;
+			for (k=0;k<128;k++) {
+				if (mf->event_map[i][j][k].type!=THRU_EVENT) mf->event_map_count[i][j]++;
+			}
+			update_midi_filter_pristine_chan(mf,i,j);
+		}
+	}
+}
+
+//Recalculate the CC predecessor table from scratch
+void update_midi_filter_cc_pred(struct midi_filter_st *mf) {
+	int i,j;
+	memset(mf->cc_pred_count,0,sizeof(mf->cc_pred_count));
+	for (i=0;i<16;i++) {
+		for (j=0;j<128;j++) {
+			struct midi_event_st *ev=&mf->event_map[CTRL_CHANGE & 0x7][i][j];
+			mf->cc_pred_count[ev->chan][ev->num]++;
+			mf->cc_pred[ev->chan][ev->num]=(i << 7) | j;
+		}
+	}
+	for (i=0;i<16;i++) {
+		for (j=0;j<128;j++) {
+			if (mf->cc_pred_count[i][j]>1) mf->cc_pred[i][j]=MF_NO_PRED;
+		}
+	}
+}
+
 int validate_midi_event(struct midi_event_st *ev) {
 	if (ev->type>0xE) {
 		fprintf (stderr, "Zyncoder: MIDI Event type (%d) is out of range!\n",ev->type);
@@ -300,12 +1107,9 @@ int validate_midi_event(struct midi_event_st *ev) {
 }
 
 void set_midi_filter_event_map_st(struct midi_event_st *ev_from, struct midi_event_st *ev_to) {
+	struct midi_filter_st *mf=edit_midi_filter();
 	if (validate_midi_event(ev_from) && validate_midi_event(ev_to)) {
-		//memcpy(&midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num],ev_to,sizeof(ev_to));
-		struct midi_event_st *event_map=&midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num];
-		event_map->type=ev_to->type;
-		event_map->chan=ev_to->chan;
-		event_map->num=ev_to->num;
+		write_midi_filter_event_map(mf,ev_from->type&0x7,ev_from->chan,ev_from->num,ev_to->type,ev_to->chan,ev_to->num);
 	}
 }
 
@@ -317,8 +1121,10 @@ void set_midi_filter_event_map(enum midi_event_type_enum type_from, uint8_t chan
 }
 
 void set_midi_filter_event_ignore_st(struct midi_event_st *ev_from) {
+	struct midi_filter_st *mf=edit_midi_filter();
 	if (validate_midi_event(ev_from)) {
-		midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num].type=IGNORE_EVENT;
+		struct midi_event_st *event_map=&mf->event_map[ev_from->type&0x7][ev_from->chan][ev_from->num];
+		write_midi_filter_event_map(mf,ev_from->type&0x7,ev_from->chan,ev_from->num,IGNORE_EVENT,event_map->chan,event_map->num);
 	}
 }
 
@@ -327,11 +1133,18 @@ void set_midi_filter_event_ignore(enum midi_event_type_enum type_from, uint8_t c
 	set_midi_filter_event_ignore_st(&ev_from);
 }
 
+//Copied out => the filter copy it comes from can be retired & freed afterwards
+int get_midi_filter_event_map_into(struct midi_event_st *ev_from, struct midi_event_st *ev_to) {
+	if (!validate_midi_event(ev_from)) return 0;
+	*ev_to=view_midi_filter()->event_map[ev_from->type&0x7][ev_from->chan][ev_from->num];
+	return 1;
+}
+
+//Pointer to a per-thread copy => valid until the next call from the same thread
 struct midi_event_st *get_midi_filter_event_map_st(struct midi_event_st *ev_from) {
-	if (validate_midi_event(ev_from)) {
-		return &midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num];
-	}
-	return NULL;
+	static _Thread_local struct midi_event_st ev_to;
+	if (!get_midi_filter_event_map_into(ev_from,&ev_to)) return NULL;
+	return &ev_to;
 }
 
 struct midi_event_st *get_midi_filter_event_map(enum midi_event_type_enum type_from, uint8_t chan_from, uint8_t num_from) {
@@ -340,10 +1153,9 @@ struct midi_event_st *get_midi_filter_event_map(enum midi_event_type_enum type_f
 }
 
 void del_midi_filter_event_map_st(struct midi_event_st *ev_from) {
+	struct midi_filter_st *mf=edit_midi_filter();
 	if (validate_midi_event(ev_from)) {
-		midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num].type=THRU_EVENT;
-		midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num].chan=ev_from->chan;
-		midi_filter.event_map[ev_from->type&0x7][ev_from->chan][ev_from->num].num=ev_from->num;
+		write_midi_filter_event_map(mf,ev_from->type&0x7,ev_from->chan,ev_from->num,THRU_EVENT,ev_from->chan,ev_from->num);
 	}
 }
 
@@ -353,13 +1165,12 @@ void del_midi_filter_event_map(enum midi_event_type_enum type_from, uint8_t chan
 }
 
 void reset_midi_filter_event_map() {
+	struct midi_filter_st *mf=edit_midi_filter();
 	int i,j,k;
 	for (i=0;i<8;i++) {
 		for (j=0;j<16;j++) {
 			for (k=0;k<128;k++) {
-				midi_filter.event_map[i][j][k].type=THRU_EVENT;
-				midi_filter.event_map[i][j][k].chan=j;
-				midi_filter.event_map[i][j][k].num=k;
+				write_midi_filter_event_map(mf,i,j,k,THRU_EVENT,j,k);
 			}
 		}
 	}
@@ -377,8 +1188,10 @@ void set_midi_filter_cc_ignore(uint8_t chan_from, uint8_t cc_from) {
 
 //TODO: It doesn't take into account if chan_from!=chan_to
 uint8_t get_midi_filter_cc_map(uint8_t chan_from, uint8_t cc_from) {
-	struct midi_event_st *ev=get_midi_filter_event_map(CTRL_CHANGE,chan_from,cc_from);
-	return ev->num;
+	struct midi_event_st ev_from={ .type=CTRL_CHANGE, .chan=chan_from, .num=cc_from };
+	struct midi_event_st ev_to={ .num=cc_from };
+	get_midi_filter_event_map_into(&ev_from,&ev_to);
+	return ev_to.num;
 }
 
 void del_midi_filter_cc_map(uint8_t chan_from, uint8_t cc_from) {
@@ -418,18 +1231,19 @@ void reset_midi_filter_cc_map() {
 //			=> In such a case, the previously existing CTRL_CHANGE arrow must be explicitly removed before
 //	+ Rule B: All paths are closed 
 //		+ ALGORITHM: Find the node Nh pointing to Ni
-//			=> from Ni, follow the path to find Nh that points to Ni
+//			=> Lookup the inverse map (cc_pred), kept by write_midi_filter_event_map
 //-----------------------------------------------------------------------------
 
 
 int get_mf_arrow_from(enum midi_event_type_enum type, uint8_t chan, uint8_t num, struct mf_arrow_st *arrow) {
-	struct midi_event_st *to=get_midi_filter_event_map(type,chan,num);
-	if (!to) return 0;
+	struct midi_event_st from={ .type=type, .chan=chan, .num=num };
+	struct midi_event_st to;
+	if (!get_midi_filter_event_map_into(&from,&to)) return 0;
 	arrow->chan_from=chan;
 	arrow->num_from=num;
-	arrow->chan_to=to->chan;
-	arrow->num_to=to->num;
-	arrow->type=to->type;
+	arrow->chan_to=to.chan;
+	arrow->num_to=to.num;
+	arrow->type=to.type;
 #ifdef DEBUG
 	//fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_from %d, %d => %d, %d (%d)\n", arrow->chan_from, arrow->num_from, arrow->chan_to, arrow->num_to, arrow->type);
 #endif
@@ -437,26 +1251,38 @@ int get_mf_arrow_from(enum midi_event_type_enum type, uint8_t chan, uint8_t num,
 }
 
 int get_mf_arrow_to(enum midi_event_type_enum type, uint8_t chan, uint8_t num, struct mf_arrow_st *arrow) {
-	int limit=0;
-	arrow->chan_to=chan;
-	arrow->num_to=num;
-	//Follow the rabbit ... ;-)
-	do {
-		if (++limit>128) {
-			fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_to => Not Closed Path or it's too long!\n");
+	struct midi_filter_st *mf=view_midi_filter();
+	if (chan>15 || num>127) {
+		fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_to => Node (%d, %d) is out of range!\n", chan, num);
+		return 0;
+	}
+	uint16_t from=MF_NO_PRED;
+	//Rule A => CC nodes have a single predecessor, taken from the inverse map
+	if ((type & 0x7)==(CTRL_CHANGE & 0x7)) {
+		from=mf->cc_pred[chan][num];
+		if (mf->cc_pred_count[chan][num]==0) {
+			fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_to => Not Closed Path!\n");
 			return 0;
 		}
-		if (!get_mf_arrow_from(type,arrow->chan_to,arrow->num_to,arrow)) {
-			fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_to => Bad Path!\n");
+	}
+	//Otherwise, search the map
+	if (from==MF_NO_PRED) {
+		int i,j;
+		struct midi_event_st (*event_map)[128]=mf->event_map[type & 0x7];
+		for (i=0;i<16 && from==MF_NO_PRED;i++) {
+			for (j=0;j<128;j++) {
+				if (event_map[i][j].chan==chan && event_map[i][j].num==num) {
+					from=(i << 7) | j;
+					break;
+				}
+			}
+		}
+		if (from==MF_NO_PRED) {
+			fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_to => Not Closed Path!\n");
 			return 0;
 		}
-#ifdef DEBUG
-		fprintf (stderr, "Zyncoder: MIDI filter get_mf_arrow_to %d, %d, %d => %d, %d (%d)\n", limit, arrow->chan_from, arrow->num_from, arrow->chan_to, arrow->num_to, arrow->type);
-#endif
-		if (arrow->type>0) type=arrow->type;
-	} while (arrow->chan_to!=chan || arrow->num_to!=num);
-	//Return 1 => last arrow pointing to origin!
-	return 1;
+	}
+	return get_mf_arrow_from(type,from >> 7,from & 0x7F,arrow);
 }
 
 
@@ -483,6 +1309,12 @@ int set_midi_filter_cc_swap(uint8_t chan_from, uint8_t num_from, uint8_t chan_to
 		return 0;
 	}
 
+	//Origin already points to destiny (THRU loop or SWAP arrow) => just make it a CTRL_CHANGE map
+	if (arrow_from.chan_to==chan_to && arrow_from.num_to==num_to) {
+		set_midi_filter_event_map(CTRL_CHANGE,chan_from,num_from,CTRL_CHANGE,chan_to,num_to);
+		return 1;
+	}
+
 	//Create CC Map from => to
 	set_midi_filter_event_map(CTRL_CHANGE,chan_from,num_from,CTRL_CHANGE,chan_to,num_to);
 #ifdef DEBUG
@@ -543,6 +1375,15 @@ int del_midi_filter_cc_swap(uint8_t chan, uint8_t num) {
 			//Create Ajy of type SWAP_EVENT
 			set_midi_filter_event_map(CTRL_CHANGE,arrow_to.chan_from,arrow_to.num_from,SWAP_EVENT,arrow.chan_to,arrow.num_to);
 		}
+		//Both were SWAP_EVENT => Ajx & Ayk are merged into Ajk, unless j is y (the swap pair itself)
+		if (arrow_to.type==SWAP_EVENT && arrow_from.type==SWAP_EVENT && (arrow_to.chan_from!=arrow.chan_to || arrow_to.num_from!=arrow.num_to)) {
+			if (arrow_to.chan_from==arrow_from.chan_to && arrow_to.num_from==arrow_from.num_to) {
+				//Create Ajj of type THRU_EVENT
+				del_midi_filter_cc_map(arrow_to.chan_from,arrow_to.num_from);
+			} else {
+				set_midi_filter_event_map(CTRL_CHANGE,arrow_to.chan_from,arrow_to.num_from,SWAP_EVENT,arrow_from.chan_to,arrow_from.num_to);
+			}
+		}
 	}
 
 	return 1;
@@ -555,26 +1396,392 @@ uint8_t get_midi_filter_cc_swap(uint8_t chan, uint8_t num) {
 	else return arrow.num_from;
 }
 
-//-----------------------------------------------------------------------------
-// MIDI Input Events Buffer Management
-//-----------------------------------------------------------------------------
+int check_midi_filter_cc_swap() {
+	struct midi_filter_st *mf=view_midi_filter();
+	struct midi_event_st (*event_map)[128]=mf->event_map[CTRL_CHANGE & 0x7];
+	uint16_t pred_count[16][128];
+	uint8_t visited[16][128];
+	int i,j,k,errors=0;
 
-int write_zynmidi(uint32_t ev) {
-	int nptr=zynmidi_buffer_write+1;
-	if (nptr>=ZYNMIDI_BUFFER_SIZE) nptr=0;
-	if (nptr==zynmidi_buffer_read) return 0;
-	zynmidi_buffer[zynmidi_buffer_write]=ev;
-	zynmidi_buffer_write=nptr;
+	memset(pred_count,0,sizeof(pred_count));
+	for (i=0;i<16;i++) {
+		for (j=0;j<128;j++) {
+			struct midi_event_st *ev=&event_map[i][j];
+			if (ev->chan>15 || ev->num>127) {
+				fprintf (stderr, "Zyncoder: MIDI filter CC swap check => Bad arrow from (%d, %d)!\n", i, j);
+				return ++errors;
+			}
+			//THRU arrows are loops
+			if (ev->type==THRU_EVENT && (ev->chan!=i || ev->num!=j)) {
+				fprintf (stderr, "Zyncoder: MIDI filter CC swap check => THRU arrow from (%d, %d) is not a loop!\n", i, j);
+				errors++;
+			}
+			pred_count[ev->chan][ev->num]++;
+		}
+	}
+
+	for (i=0;i<16;i++) {
+		for (j=0;j<128;j++) {
+			//Inverse map must agree with the event map
+			if (pred_count[i][j]!=mf->cc_pred_count[i][j]) {
+				fprintf (stderr, "Zyncoder: MIDI filter CC swap check => Bad predecessor count for (%d, %d)!\n", i, j);
+				errors++;
+			}
+			uint16_t from=mf->cc_pred[i][j];
+			if (from!=MF_NO_PRED && (event_map[from >> 7][from & 0x7F].chan!=i || event_map[from >> 7][from & 0x7F].num!=j)) {
+				fprintf (stderr, "Zyncoder: MIDI filter CC swap check => Bad predecessor for (%d, %d)!\n", i, j);
+				errors++;
+			}
+			//Rule A => one arrow received by every node (one emitted is granted by the map)
+			if (pred_count[i][j]!=1) {
+				fprintf (stderr, "Zyncoder: MIDI filter CC swap check => Node (%d, %d) receives %d arrows!\n", i, j, pred_count[i][j]);
+				errors++;
+			}
+		}
+	}
+	if (errors) return errors;
+
+	//Rule B => following the arrows from every node leads back to it
+	memset(visited,0,sizeof(visited));
+	for (i=0;i<16;i++) {
+		for (j=0;j<128;j++) {
+			if (visited[i][j]) continue;
+			uint8_t c=i, n=j;
+			for (k=0;k<16*128;k++) {
+				visited[c][n]=1;
+				struct midi_event_st *ev=&event_map[c][n];
+				c=ev->chan;
+				n=ev->num;
+				if (c==i && n==j) break;
+			}
+			if (k==16*128) {
+				fprintf (stderr, "Zyncoder: MIDI filter CC swap check => Path from (%d, %d) is not closed!\n", i, j);
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+//-----------------------------------------------------------------------------
+// MIDI filter presets
+//-----------------------------------------------------------------------------
+
+//Binary preset file => header + data, in host byte order. Derived state (struct map,
+//pristine state, CC predecessors) is rebuilt when loading.
+#define MIDI_FILTER_PRESET_MAGIC "ZMFP"
+#define MIDI_FILTER_PRESET_VERSION 1
+#define MIDI_FILTER_PRESET_BYTE_ORDER 0x0102
+
+struct midi_filter_preset_header_st {
+	char magic[4];
+	uint16_t version;
+	uint16_t byte_order;
+	uint32_t size;
+};
+
+struct midi_filter_preset_data_st {
+	int32_t tuning_pitchbend;
+	int32_t transpose[16];
+	int32_t master_chan;
+	uint16_t event_map[8][16][128];
+};
+
+//Preloaded presets => read-only once published, jack thread can switch to them
+_Atomic(struct midi_filter_st *) midi_filter_presets[MIDI_FILTER_PRESETS_MAX];
+atomic_int midi_filter_preset_chan=-1;
+
+//Replaced presets are released when jack thread can't be using them anymore
+#define MIDI_FILTER_RETIRED_MAX 16
+#define MIDI_FILTER_RETIRE_TIMEOUT_MS 500
+struct midi_filter_retired_st {
+	struct midi_filter_st *mf;
+	unsigned int cycle;
+	int safe;
+} midi_filter_retired[MIDI_FILTER_RETIRED_MAX];
+
+int validate_midi_filter_preset_data(struct midi_filter_preset_data_st *data) {
+	int i,j,k;
+	if (data->tuning_pitchbend<-1 || data->tuning_pitchbend>16383) return 0;
+	if (data->master_chan<-1 || data->master_chan>15) return 0;
+	for (i=0;i<16;i++) {
+		if (data->transpose[i]<-60 || data->transpose[i]>60) return 0;
+	}
+	for (i=0;i<8;i++) {
+		for (j=0;j<16;j++) {
+			for (k=0;k<128;k++) {
+				int type=MF_PACKED_TYPE(data->event_map[i][j][k]);
+				if (type>THRU_EVENT && (type<NOTE_OFF || type>PITCH_BENDING)) return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+void read_midi_filter_preset_data(struct midi_filter_st *mf, struct midi_filter_preset_data_st *data) {
+	int i,j,k;
+	mf->tuning_pitchbend=data->tuning_pitchbend;
+	mf->master_chan=data->master_chan;
+	for (i=0;i<16;i++) {
+		mf->transpose[i]=data->transpose[i];
+	}
+	memcpy(mf->event_map_packed,data->event_map,sizeof(mf->event_map_packed));
+	for (i=0;i<8;i++) {
+		for (j=0;j<16;j++) {
+			for (k=0;k<128;k++) {
+				uint16_t pev=data->event_map[i][j][k];
+				mf->event_map[i][j][k].type=MF_PACKED_TYPE(pev);
+				mf->event_map[i][j][k].chan=MF_PACKED_CHAN(pev);
+				mf->event_map[i][j][k].num=MF_PACKED_NUM(pev);
+			}
+		}
+	}
+	update_midi_filter_pristine(mf);
+	update_midi_filter_cc_pred(mf);
+}
+
+void write_midi_filter_preset_data(struct midi_filter_st *mf, struct midi_filter_preset_data_st *data) {
+	int i;
+	data->tuning_pitchbend=mf->tuning_pitchbend;
+	data->master_chan=mf->master_chan;
+	for (i=0;i<16;i++) {
+		data->transpose[i]=mf->transpose[i];
+	}
+	memcpy(data->event_map,mf->event_map_packed,sizeof(data->event_map));
+}
+
+//Map a preset file and read it into "mf"
+int read_midi_filter_preset(struct midi_filter_st *mf, const char *fpath) {
+	int res=-1;
+	int fd=open(fpath,O_RDONLY);
+	if (fd<0) {
+		fprintf (stderr, "Zyncoder: Can't open MIDI filter preset '%s'!\n",fpath);
+		return -1;
+	}
+	struct stat st;
+	size_t size=sizeof(struct midi_filter_preset_header_st)+sizeof(struct midi_filter_preset_data_st);
+	if (fstat(fd,&st) || st.st_size!=size) {
+		fprintf (stderr, "Zyncoder: Bad MIDI filter preset size '%s'!\n",fpath);
+		close(fd);
+		return -1;
+	}
+	void *map=mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (map==MAP_FAILED) {
+		fprintf (stderr, "Zyncoder: Can't map MIDI filter preset '%s'!\n",fpath);
+		return -1;
+	}
+	struct midi_filter_preset_header_st *header=map;
+	struct midi_filter_preset_data_st *data=(struct midi_filter_preset_data_st *)(header+1);
+	if (memcmp(header->magic,MIDI_FILTER_PRESET_MAGIC,4) || header->byte_order!=MIDI_FILTER_PRESET_BYTE_ORDER) {
+		fprintf (stderr, "Zyncoder: '%s' is not a MIDI filter preset!\n",fpath);
+	} else if (header->version!=MIDI_FILTER_PRESET_VERSION || header->size!=sizeof(struct midi_filter_preset_data_st)) {
+		fprintf (stderr, "Zyncoder: Unsupported MIDI filter preset version (%d)!\n",header->version);
+	} else if (!validate_midi_filter_preset_data(data)) {
+		fprintf (stderr, "Zyncoder: Bad MIDI filter preset data '%s'!\n",fpath);
+	} else {
+		read_midi_filter_preset_data(mf,data);
+		res=0;
+	}
+	munmap(map,size);
+	return res;
+}
+
+int save_midi_filter(const char *fpath) {
+	struct midi_filter_preset_header_st header;
+	struct midi_filter_preset_data_st *data=malloc(sizeof(struct midi_filter_preset_data_st));
+	if (!data) return -1;
+	memcpy(header.magic,MIDI_FILTER_PRESET_MAGIC,4);
+	header.version=MIDI_FILTER_PRESET_VERSION;
+	header.byte_order=MIDI_FILTER_PRESET_BYTE_ORDER;
+	header.size=sizeof(struct midi_filter_preset_data_st);
+	write_midi_filter_preset_data(view_midi_filter(),data);
+
+	int res=-1;
+	FILE *f=fopen(fpath,"wb");
+	if (f) {
+		if (fwrite(&header,sizeof(header),1,f)==1 && fwrite(data,sizeof(struct midi_filter_preset_data_st),1,f)==1) res=0;
+		if (fclose(f)) res=-1;
+	}
+	if (res) fprintf (stderr, "Zyncoder: Can't save MIDI filter preset '%s'!\n",fpath);
+	free(data);
+	return res;
+}
+
+int load_midi_filter(const char *fpath) {
+	//Load on the shadow copy => published on commit
+	int transaction=midi_filter_transaction;
+	if (!transaction) begin_midi_filter_transaction();
+	if (read_midi_filter_preset(midi_filter,fpath)) {
+		if (!transaction) abort_midi_filter_transaction();
+		return -1;
+	}
+	if (!transaction) commit_midi_filter_transaction();
+	return 0;
+}
+
+void reclaim_midi_filter_presets() {
+	int i;
+	for (i=0;i<MIDI_FILTER_RETIRED_MAX;i++) {
+		struct midi_filter_retired_st *r=midi_filter_retired+i;
+		if (!r->mf) continue;
+		//Jack cycle running when retired could have selected it => wait until it's finished
+		if (!r->safe && atomic_load(&midi_filter_cycles)==r->cycle) continue;
+		if (r->mf==atomic_load(&midi_filter_active) || r->mf==atomic_load(&midi_filter_rt_used)) continue;
+		munlock(r->mf,sizeof(struct midi_filter_st));
+		free(r->mf);
+		r->mf=NULL;
+	}
+}
+
+//Get a free retired slot, waiting for jack thread to release the used ones. Slots can stay
+//pinned (i.e. an unloaded preset is still the active filter) => give up after a timeout.
+int get_midi_filter_retired_slot() {
+	int i, ms;
+	for (ms=0;ms<MIDI_FILTER_RETIRE_TIMEOUT_MS;ms++) {
+		reclaim_midi_filter_presets();
+		for (i=0;i<MIDI_FILTER_RETIRED_MAX;i++) {
+			if (!midi_filter_retired[i].mf) return i;
+		}
+		usleep(1000);
+	}
+	fprintf (stderr, "Zyncoder: No free slot for retiring MIDI filter preset!\n");
+	return -1;
+}
+
+void retire_midi_filter_preset(int slot, struct midi_filter_st *mf) {
+	if (!mf) return;
+	struct midi_filter_retired_st *r=midi_filter_retired+slot;
+	r->cycle=atomic_load(&midi_filter_cycles);
+	r->safe=(atomic_load(&midi_filter_rt_used)==NULL);
+	r->mf=mf;
+}
+
+int load_midi_filter_preset(uint8_t i, const char *fpath) {
+	if (i>=MIDI_FILTER_PRESETS_MAX) {
+		fprintf (stderr, "Zyncoder: MIDI filter preset (%d) is out of range!\n",i);
+		return -1;
+	}
+	struct midi_filter_st *mf=calloc(1,sizeof(struct midi_filter_st));
+	if (!mf) return -1;
+	if (mlock(mf,sizeof(struct midi_filter_st))) {
+		fprintf (stderr, "Zyncoder: Error locking memory for MIDI filter preset.\n");
+	}
+	int slot=-1;
+	if (read_midi_filter_preset(mf,fpath) || (slot=get_midi_filter_retired_slot())<0) {
+		munlock(mf,sizeof(struct midi_filter_st));
+		free(mf);
+		return -1;
+	}
+	retire_midi_filter_preset(slot,atomic_exchange(&midi_filter_presets[i],mf));
+	return 0;
+}
+
+int unload_midi_filter_preset(uint8_t i) {
+	if (i>=MIDI_FILTER_PRESETS_MAX || !atomic_load(&midi_filter_presets[i])) return 0;
+	int slot=get_midi_filter_retired_slot();
+	if (slot<0) return -1;
+	retire_midi_filter_preset(slot,atomic_exchange(&midi_filter_presets[i],NULL));
+	return 0;
+}
+
+int select_midi_filter_preset(uint8_t i) {
+	if (midi_filter_transaction) {
+		fprintf (stderr, "Zyncoder: Can't select MIDI filter preset inside a transaction!\n");
+		return -1;
+	}
+	struct midi_filter_st *mf=(i<MIDI_FILTER_PRESETS_MAX) ? atomic_load(&midi_filter_presets[i]) : NULL;
+	if (!mf) {
+		fprintf (stderr, "Zyncoder: MIDI filter preset (%d) is not loaded!\n",i);
+		return -1;
+	}
+	atomic_store(&midi_filter_active,mf);
+	midi_filter=mf;
+	return 0;
+}
+
+void set_midi_filter_preset_chan(int chan) {
+	if (chan>15) chan=-1;
+	atomic_store(&midi_filter_preset_chan,chan);
+}
+
+void end_midi_filter_presets() {
+	int i;
+	for (i=0;i<MIDI_FILTER_PRESETS_MAX;i++) unload_midi_filter_preset(i);
+}
+
+//Called from jack_process => Program Change on the presets channel selects a preloaded preset.
+//It's used from the next cycle.
+void jack_select_midi_filter_preset(jack_midi_event_t *ev) {
+	if ((ev->buffer[0] & 0xF0)==(PROG_CHANGE << 4) && (ev->buffer[0] & 0x0F)==atomic_load(&midi_filter_preset_chan) && ev->size>1) {
+		struct midi_filter_st *mf=atomic_load(&midi_filter_presets[ev->buffer[1] & 0x7F]);
+		if (mf) atomic_store(&midi_filter_active,mf);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// MIDI Input Events Buffer Management
+//-----------------------------------------------------------------------------
+
+//Single-producer (jack thread) / single-consumer (UI thread) lock-free ring.
+//Indexes are free-running and wrapped with the mask when accessing the array.
+
+#if (ZYNMIDI_BUFFER_SIZE & (ZYNMIDI_BUFFER_SIZE-1))!=0
+#error "ZYNMIDI_BUFFER_SIZE must be a power of two"
+#endif
+#define ZYNMIDI_BUFFER_MASK (ZYNMIDI_BUFFER_SIZE-1)
+
+struct zynmidi_buffer_st {
+	uint32_t events[ZYNMIDI_BUFFER_SIZE];
+	_Alignas(64) atomic_uint write;
+	_Alignas(64) atomic_uint read;
+	atomic_uint overflows;
+};
+struct zynmidi_buffer_st zynmidi_buffer;
+
+void init_zynmidi_buffer() {
+	memset(zynmidi_buffer.events,0,sizeof(zynmidi_buffer.events));
+	atomic_init(&zynmidi_buffer.write,0);
+	atomic_init(&zynmidi_buffer.read,0);
+	atomic_init(&zynmidi_buffer.overflows,0);
+}
+
+int write_zynmidi(uint32_t ev) {
+	unsigned int wptr=atomic_load_explicit(&zynmidi_buffer.write,memory_order_relaxed);
+	unsigned int rptr=atomic_load_explicit(&zynmidi_buffer.read,memory_order_acquire);
+	if (wptr-rptr>=ZYNMIDI_BUFFER_SIZE) {
+		atomic_fetch_add_explicit(&zynmidi_buffer.overflows,1,memory_order_relaxed);
+		return 0;
+	}
+	zynmidi_buffer.events[wptr & ZYNMIDI_BUFFER_MASK]=ev;
+	atomic_store_explicit(&zynmidi_buffer.write,wptr+1,memory_order_release);
 	return 1;
 }
 
 uint32_t read_zynmidi() {
-	if (zynmidi_buffer_read==zynmidi_buffer_write) return 0;
-	uint32_t ev=zynmidi_buffer[zynmidi_buffer_read++];
-	if (zynmidi_buffer_read>=ZYNMIDI_BUFFER_SIZE) zynmidi_buffer_read=0;
+	unsigned int rptr=atomic_load_explicit(&zynmidi_buffer.read,memory_order_relaxed);
+	unsigned int wptr=atomic_load_explicit(&zynmidi_buffer.write,memory_order_acquire);
+	if (rptr==wptr) return 0;
+	uint32_t ev=zynmidi_buffer.events[rptr & ZYNMIDI_BUFFER_MASK];
+	atomic_store_explicit(&zynmidi_buffer.read,rptr+1,memory_order_release);
 	return ev;
 }
 
+//Read up to "max" events with a single call. Returns the number of events read.
+int read_zynmidi_batch(uint32_t *out, int max) {
+	unsigned int rptr=atomic_load_explicit(&zynmidi_buffer.read,memory_order_relaxed);
+	unsigned int wptr=atomic_load_explicit(&zynmidi_buffer.write,memory_order_acquire);
+	int i,n=wptr-rptr;
+	if (n>max) n=max;
+	for (i=0;i<n;i++) out[i]=zynmidi_buffer.events[(rptr+i) & ZYNMIDI_BUFFER_MASK];
+	if (n>0) atomic_store_explicit(&zynmidi_buffer.read,rptr+n,memory_order_release);
+	return n;
+}
+
+unsigned int get_zynmidi_overflow_count() {
+	return atomic_load_explicit(&zynmidi_buffer.overflows,memory_order_relaxed);
+}
+
 //-----------------------------------------------------------------------------
 // Jack MIDI processing
 //-----------------------------------------------------------------------------
@@ -582,11 +1789,72 @@ uint32_t read_zynmidi() {
 jack_client_t *jack_client;
 jack_port_t *jack_midi_output_port;
 jack_port_t *jack_midi_input_port;
-jack_ringbuffer_t *jack_ring_output_buffer;
-uint8_t jack_midi_data[3*1024];
+struct zynqueue_st jack_out_queue;
+
+//Timestamped MIDI event, as queued in jack_out_queue and staged for output.
+//Queued events carry the absolute JACK frame time when they were sent. Staged events
+//carry the frame offset inside the current cycle.
+struct zynmidi_event_st {
+	jack_nframes_t time;
+	uint8_t size;
+	uint8_t data[3];
+};
+
+//Per-cycle output staging, flushed to the jack output port in time order.
+//Short messages are copied inline. Long ones (SysEx) point to the source data,
+//that must be valid until the end of the cycle => copied only once, when flushing.
+//System realtime messages (0xF8-0xFF) have priority => they are written first when
+//sharing the same frame, and output space is kept for them.
+struct jack_out_event_st {
+	jack_nframes_t time;
+	uint32_t size;
+	uint8_t *data;
+	uint8_t buffer[3];
+	uint8_t realtime;
+};
+
+#define JACK_OUT_EVENTS_MAX 1024
+//Output buffer space kept for every pending realtime message (data + jack event header)
+#define JACK_OUT_REALTIME_HEADROOM 16
+struct jack_out_event_st jack_out_events[JACK_OUT_EVENTS_MAX];
+int jack_out_nevents=0;
+int jack_out_nrealtime=0;
+jack_nframes_t jack_out_last_time;
+jack_nframes_t jack_out_cycle_start;
+
+//Realtime messages sent from API calls => separate queue, drained first
+struct zynqueue_st jack_realtime_queue;
+
+//Producers of the queues above, the scheduler and the SysEx queue (ISR & API threads)
+struct zyngate_st zynmidi_gate;
+
+//MIDI clock statistics => intervals between output clock ticks, in frames. Written by
+//jack thread only, inside a seqlock (odd sequence => update in progress). Reset requests
+//are flagged and applied by jack thread on its next cycle.
+struct zynmidi_clock_stats_st zynmidi_clock_stats;
+jack_nframes_t zynmidi_clock_last_tick;
+atomic_uint zynmidi_clock_stats_seq=0;
+atomic_int zynmidi_clock_stats_reset=0;
+
+//SysEx output queue => [uint32_t size][data] records. Producers are serialized by a
+//mutex, jack_process reads it without locking.
+#define ZYNMIDI_SYSEX_QUEUE_SIZE (64*1024)
+jack_ringbuffer_t *jack_sysex_queue;
+pthread_mutex_t jack_sysex_queue_mutex=PTHREAD_MUTEX_INITIALIZER;
+unsigned int zynmidi_sysex_rate=0;
+//Credit in bytes*sample_rate => no rounding loss per cycle, whatever the rate & buffer size
+int64_t zynmidi_sysex_credit=0;
+//Largest event that fits in an empty output buffer, updated by jack thread every cycle.
+//Longer SysEx messages are rejected by zynmidi_send_sysex, as they could never be sent.
+atomic_size_t jack_out_max_event_size=0;
 
 int jack_process(jack_nframes_t nframes, void *arg);
 int jack_write_midi_event(uint8_t *event, int event_size);
+void update_midi_clock_stats(jack_nframes_t tick);
+void jack_reset_midi_clock_stats();
+void jack_out_zyncoders();
+int init_zynmidi_schedule();
+void end_zynmidi_schedule();
 
 int init_zyncoder_midi(char *name) {
 	if ((jack_client = jack_client_open(name, JackNullOption , 0 , 0 )) == NULL) {
@@ -603,10 +1871,25 @@ int init_zyncoder_midi(char *name) {
 		fprintf (stderr, "Zyncoder: Error creating jack midi input port.\n");
 		return -2;
 	}
-	jack_ring_output_buffer = jack_ringbuffer_create(3*1024);
+	init_zynlog();
+	//Multi-producer queue: jack thread, ISR threads & API calls write to it concurrently
+	if (zynqueue_init(&jack_out_queue, 1024, sizeof(struct zynmidi_event_st))) {
+		fprintf (stderr, "Zyncoder: Error creating jack midi output queue.\n");
+		return -3;
+	}
+	if (zynqueue_init(&jack_realtime_queue, 256, sizeof(struct zynmidi_event_st))) {
+		fprintf (stderr, "Zyncoder: Error creating jack midi realtime queue.\n");
+		return -3;
+	}
+	if (init_zynmidi_schedule()) {
+		fprintf (stderr, "Zyncoder: Error creating MIDI scheduler queue.\n");
+		return -3;
+	}
+	reset_midi_clock_stats();
+	jack_sysex_queue = jack_ringbuffer_create(ZYNMIDI_SYSEX_QUEUE_SIZE);
 	// lock the buffer into memory, this is *NOT* realtime safe, do it before using the buffer!
-	if (jack_ringbuffer_mlock(jack_ring_output_buffer)) {
-		fprintf (stderr, "Zyncoder: Error locking memory for jack ring output buffer.\n");
+	if (jack_ringbuffer_mlock(jack_sysex_queue)) {
+		fprintf (stderr, "Zyncoder: Error locking memory for jack sysex queue.\n");
 		return -3;
 	}
 	jack_set_process_callback(jack_client, jack_process, 0);
@@ -614,52 +1897,543 @@ int init_zyncoder_midi(char *name) {
 		fprintf (stderr, "Zyncoder: Error activating jack client.\n");
 		return -4;
 	}
+	zyngate_open(&zynmidi_gate);
 	return 0;
 }
 
 int end_zyncoder_midi() {
-	return jack_client_close(jack_client);
+	//Wait for the ISR/API threads sending MIDI before freeing what they use
+	zyngate_close(&zynmidi_gate);
+	int res=jack_client_close(jack_client);
+	end_midi_filter_presets();
+	zynqueue_free(&jack_out_queue);
+	zynqueue_free(&jack_realtime_queue);
+	end_zynmidi_schedule();
+	jack_ringbuffer_free(jack_sysex_queue);
+	end_zynlog();
+	return res;
 }
 
 int jack_write_midi_event(uint8_t *event_buffer, int event_size) {
-	if (jack_ringbuffer_write_space(jack_ring_output_buffer)>=event_size) {
-		if (jack_ringbuffer_write(jack_ring_output_buffer, event_buffer, event_size)!=event_size) {
-			fprintf (stderr, "Zyncoder: Error writing jack ring output buffer: INCOMPLETE\n");
-			return -1;
-		}
+	struct zynmidi_event_st qev;
+	if (event_size<1 || event_size>3) {
+		zynlog(ZYNCODER_ERR_OUTPUT_EVENT_SIZE, event_size);
+		return -1;
 	}
-	else {
-		fprintf (stderr, "Zyncoder: Error writing jack ring output buffer: FULL\n");
+	if (!zyngate_enter(&zynmidi_gate)) return -1;
+	qev.time=jack_frame_time(jack_client);
+	qev.size=event_size;
+	memcpy(qev.data,event_buffer,event_size);
+	//System realtime messages go through the priority lane
+	int res=zynqueue_push(event_buffer[0]>=0xF8 ? &jack_realtime_queue : &jack_out_queue, &qev);
+	zyngate_leave(&zynmidi_gate);
+	if (res) {
+		zynlog(ZYNCODER_ERR_OUTPUT_QUEUE_FULL, qev.data[0]);
 		return -1;
 	}
 	return 0;
 }
 
-int jack_process(jack_nframes_t nframes, void *arg) {
-	int i=0;
+//Stage an event for output at frame offset "time" of the current cycle
+int jack_out_event(jack_nframes_t time, uint8_t *event_buffer, uint8_t event_size) {
+	if (event_size<1 || event_size>3) {
+		zynlog(ZYNCODER_ERR_OUTPUT_EVENT_SIZE, event_size);
+		return -1;
+	}
+	if (jack_out_nevents>=JACK_OUT_EVENTS_MAX) {
+		zynlog(ZYNCODER_ERR_OUTPUT_TOO_MANY_EVENTS, event_buffer[0]);
+		return -1;
+	}
+	struct jack_out_event_st *oev=jack_out_events+jack_out_nevents++;
+	oev->time=time;
+	oev->size=event_size;
+	oev->data=NULL;
+	memcpy(oev->buffer,event_buffer,event_size);
+	oev->realtime=0;
+	return 0;
+}
+
+//Stage a system realtime message (1 byte) in the priority lane
+int jack_out_realtime(jack_nframes_t time, uint8_t status) {
+	if (jack_out_event(time,&status,1)) return -1;
+	jack_out_events[jack_out_nevents-1].realtime=1;
+	jack_out_nrealtime++;
+	return 0;
+}
+
+//Stage a long event (SysEx) without copying it. Data must be valid until the end of the cycle.
+int jack_out_event_ref(jack_nframes_t time, uint8_t *event_buffer, uint32_t event_size) {
+	if (jack_out_nevents>=JACK_OUT_EVENTS_MAX) {
+		zynlog(ZYNCODER_ERR_OUTPUT_TOO_MANY_EVENTS, event_buffer[0]);
+		return -1;
+	}
+	struct jack_out_event_st *oev=jack_out_events+jack_out_nevents++;
+	oev->time=time;
+	oev->size=event_size;
+	oev->data=event_buffer;
+	oev->realtime=0;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Output coalescing => only the latest value of continuous messages
+//-----------------------------------------------------------------------------
+
+//Coalesced types => KEY_PRESS, CTRL_CHANGE, (PROG_CHANGE), CHAN_PRESS, PITCH_BENDING
+#define COALESCE_TYPE_INDEX(type) ((type)-KEY_PRESS)
+#define NUM_COALESCE_TYPES 5
+
+atomic_uint zynmidi_coalesce_types;
+atomic_uint zynmidi_coalesce_counters[NUM_COALESCE_TYPES];
+
+//Latest staged event for every (type, chan, num), stamped with the flush number
+struct jack_coalesce_st {
+	uint32_t stamp;
+	uint16_t index;
+} jack_coalesce_map[NUM_COALESCE_TYPES][16][128];
+uint32_t jack_coalesce_stamp=0;
+
+int validate_coalesce_type(enum midi_event_type_enum type) {
+	if (type!=KEY_PRESS && type!=CTRL_CHANGE && type!=CHAN_PRESS && type!=PITCH_BENDING) {
+		fprintf (stderr, "Zyncoder: MIDI coalescing not supported for event type (%d)!\n",type);
+		return 0;
+	}
+	return 1;
+}
+
+void set_zynmidi_coalesce(enum midi_event_type_enum type, int enabled) {
+	if (!validate_coalesce_type(type)) return;
+	if (enabled) atomic_fetch_or(&zynmidi_coalesce_types,1 << COALESCE_TYPE_INDEX(type));
+	else atomic_fetch_and(&zynmidi_coalesce_types,~(1 << COALESCE_TYPE_INDEX(type)));
+}
+
+unsigned int get_zynmidi_coalesce_count(enum midi_event_type_enum type) {
+	if (!validate_coalesce_type(type)) return 0;
+	return atomic_load_explicit(&zynmidi_coalesce_counters[COALESCE_TYPE_INDEX(type)],memory_order_relaxed);
+}
+
+void reset_zynmidi_coalesce_counts() {
+	int i;
+	for (i=0;i<NUM_COALESCE_TYPES;i++) atomic_store_explicit(&zynmidi_coalesce_counters[i],0,memory_order_relaxed);
+}
+
+//Drop staged events superseded by a later one with the same (type, chan, num), unless a barrier
+//on the channel comes between them: note & program change messages, and the CCs whose order
+//matters (bank select, data entry, RPN/NRPN), that are never coalesced themselves.
+//Events must be sorted => walk them backwards.
+#define IS_COALESCE_BARRIER_CC(num) ((num)==0 || (num)==32 || (num)==6 || (num)==38 || ((num)>=96 && (num)<=101))
+void jack_out_coalesce(unsigned int types) {
+	int i;
+	int barrier_index[16];
+	for (i=0;i<16;i++) barrier_index[i]=JACK_OUT_EVENTS_MAX;
+	if (++jack_coalesce_stamp==0) {
+		memset(jack_coalesce_map,0,sizeof(jack_coalesce_map));
+		jack_coalesce_stamp=1;
+	}
+	for (i=jack_out_nevents-1;i>=0;i--) {
+		struct jack_out_event_st *oev=jack_out_events+i;
+		if (oev->realtime || oev->size>3) continue;
+		uint8_t *data=oev->data ? oev->data : oev->buffer;
+		uint8_t type=data[0] >> 4;
+		uint8_t chan=data[0] & 0xF;
+		if (type==NOTE_OFF || type==NOTE_ON || type==PROG_CHANGE || (type==CTRL_CHANGE && IS_COALESCE_BARRIER_CC(data[1] & 0x7F))) {
+			barrier_index[chan]=i;
+			continue;
+		}
+		if (type<KEY_PRESS || type>PITCH_BENDING) continue;
+		int ti=COALESCE_TYPE_INDEX(type);
+		if (!(types & (1 << ti))) continue;
+		uint8_t num=(type==KEY_PRESS || type==CTRL_CHANGE) ? data[1] & 0x7F : 0;
+		struct jack_coalesce_st *latest=&jack_coalesce_map[ti][chan][num];
+		if (latest->stamp==jack_coalesce_stamp && barrier_index[chan]>latest->index) {
+			oev->size=0;
+			atomic_fetch_add_explicit(&zynmidi_coalesce_counters[ti],1,memory_order_relaxed);
+		} else {
+			latest->stamp=jack_coalesce_stamp;
+			latest->index=i;
+		}
+	}
+}
+
+//Write staged events to the jack output buffer, sorted by frame offset
+int jack_out_flush(void *output_port_buffer) {
+	int i,j,n=0;
+	uint8_t *buffer;
+	struct jack_out_event_st oev;
+
+	//Stable insertion sort => staged events are mostly in order already.
+	//Realtime messages go first inside the same frame.
+	for (i=1;i<jack_out_nevents;i++) {
+		oev=jack_out_events[i];
+		for (j=i;j>0;j--) {
+			struct jack_out_event_st *prev=jack_out_events+j-1;
+			if (prev->time<oev.time || (prev->time==oev.time && (prev->realtime || !oev.realtime))) break;
+			jack_out_events[j]=*prev;
+		}
+		jack_out_events[j]=oev;
+	}
+
+	unsigned int coalesce_types=atomic_load_explicit(&zynmidi_coalesce_types,memory_order_relaxed);
+	if (coalesce_types) jack_out_coalesce(coalesce_types);
+
+	jack_out_last_time=0;
+	for (i=0;i<jack_out_nevents;i++) {
+		struct jack_out_event_st *oevp=jack_out_events+i;
+		//Coalesced
+		if (oevp->size==0) continue;
+		if (oevp->realtime) {
+			jack_out_nrealtime--;
+		}
+		//Keep output space for pending realtime messages
+		else if (jack_out_nrealtime>0 && jack_midi_max_event_size(output_port_buffer)<oevp->size+jack_out_nrealtime*JACK_OUT_REALTIME_HEADROOM) {
+			zynlog(ZYNCODER_ERR_OUTPUT_BUFFER_FULL, oevp->size);
+			continue;
+		}
+		buffer = jack_midi_event_reserve(output_port_buffer, oevp->time, oevp->size);
+		if (buffer==NULL) {
+			zynlog(ZYNCODER_ERR_OUTPUT_BUFFER_FULL, oevp->size);
+			continue;
+		}
+		memcpy(buffer, oevp->data ? oevp->data : oevp->buffer, oevp->size);
+		jack_out_last_time=oevp->time;
+		if (oevp->realtime && oevp->buffer[0]==0xF8) update_midi_clock_stats(jack_out_cycle_start+oevp->time);
+		n++;
+	}
+	jack_out_nevents=0;
+	jack_out_nrealtime=0;
+	return n;
+}
+
+//Frame offset inside the current cycle for an event queued at frame time "time".
+//Events sent during the previous cycle are delayed exactly one period => constant latency.
+jack_nframes_t jack_queued_event_offset(jack_nframes_t time, jack_nframes_t nframes) {
+	int32_t offset=(int32_t)(time-jack_out_cycle_start)+(int32_t)nframes;
+	if (offset<0) return 0;
+	else if (offset>=nframes) return nframes-1;
+	return offset;
+}
+
+//-----------------------------------------------------------------------------
+// MIDI clock statistics
+//-----------------------------------------------------------------------------
+
+//Longer gaps between ticks (s) are a clock stop/start => stats restart from the new tick.
+//This also keeps the intervals far from overflowing the Q8 fixed point maths.
+#define ZYNMIDI_CLOCK_MAX_GAP_S 2
+
+void update_midi_clock_stats(jack_nframes_t tick) {
+	struct zynmidi_clock_stats_st *stats=&zynmidi_clock_stats;
+	unsigned int seq=atomic_load_explicit(&zynmidi_clock_stats_seq,memory_order_relaxed);
+	atomic_store_explicit(&zynmidi_clock_stats_seq,seq+1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	if (stats->ticks>0 && tick-zynmidi_clock_last_tick>ZYNMIDI_CLOCK_MAX_GAP_S*jack_get_sample_rate(jack_client)) {
+		memset(stats,0,sizeof(struct zynmidi_clock_stats_st));
+	}
+	if (stats->ticks++>0) {
+		unsigned int interval=tick-zynmidi_clock_last_tick;
+		stats->last_interval=interval;
+		if (stats->ticks==2) {
+			stats->min_interval=stats->max_interval=interval;
+			stats->mean_interval_q8=interval<<8;
+			stats->jitter_q8=0;
+		} else {
+			if (interval<stats->min_interval) stats->min_interval=interval;
+			if (interval>stats->max_interval) stats->max_interval=interval;
+			//Exponential moving averages (1/16), fixed point Q8
+			int d=(int)(interval<<8)-(int)stats->mean_interval_q8;
+			stats->mean_interval_q8+=d/16;
+			if (d<0) d=-d;
+			stats->jitter_q8+=(d-(int)stats->jitter_q8)/16;
+		}
+	}
+	zynmidi_clock_last_tick=tick;
+	atomic_store_explicit(&zynmidi_clock_stats_seq,seq+2,memory_order_release);
+}
+
+//Called by jack thread at the start of every cycle
+void jack_reset_midi_clock_stats() {
+	if (!atomic_load_explicit(&zynmidi_clock_stats_reset,memory_order_acquire)) return;
+	unsigned int seq=atomic_load_explicit(&zynmidi_clock_stats_seq,memory_order_relaxed);
+	atomic_store_explicit(&zynmidi_clock_stats_seq,seq+1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memset(&zynmidi_clock_stats,0,sizeof(struct zynmidi_clock_stats_st));
+	atomic_store_explicit(&zynmidi_clock_stats_seq,seq+2,memory_order_release);
+	atomic_store_explicit(&zynmidi_clock_stats_reset,0,memory_order_relaxed);
+}
+
+void get_midi_clock_stats(struct zynmidi_clock_stats_st *stats) {
+	unsigned int seq;
+	//Retry while jack thread is updating the stats
+	do {
+		do seq=atomic_load_explicit(&zynmidi_clock_stats_seq,memory_order_acquire);
+		while (seq & 1);
+		memcpy(stats,&zynmidi_clock_stats,sizeof(struct zynmidi_clock_stats_st));
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&zynmidi_clock_stats_seq,memory_order_relaxed)!=seq);
+	stats->sample_rate=jack_client ? jack_get_sample_rate(jack_client) : 0;
+}
+
+void reset_midi_clock_stats() {
+	atomic_store_explicit(&zynmidi_clock_stats_reset,1,memory_order_release);
+}
+
+//-----------------------------------------------------------------------------
+
+//Write queued SysEx messages after the staged events, as output space and rate allow.
+//Messages that don't fit wait for the next cycle => back-pressure to zynmidi_send_sysex.
+void jack_out_sysex(void *output_port_buffer, jack_nframes_t nframes, int nwritten) {
+	uint32_t size;
+	uint8_t *buffer;
+	int64_t sample_rate=jack_get_sample_rate(jack_client);
+
+	//Rate limit => credit of bytes, accumulated every cycle
+	if (zynmidi_sysex_rate>0) {
+		zynmidi_sysex_credit+=(int64_t)zynmidi_sysex_rate*nframes;
+		if (zynmidi_sysex_credit>ZYNMIDI_SYSEX_QUEUE_SIZE*sample_rate) zynmidi_sysex_credit=ZYNMIDI_SYSEX_QUEUE_SIZE*sample_rate;
+	}
+
+	while (jack_ringbuffer_read_space(jack_sysex_queue)>=sizeof(size)) {
+		jack_ringbuffer_peek(jack_sysex_queue, (char *)&size, sizeof(size));
+		if (zynmidi_sysex_rate>0 && zynmidi_sysex_credit<size*sample_rate) break;
+		if (jack_midi_max_event_size(output_port_buffer)<size) {
+			//It doesn't fit in an empty buffer => it never will
+			if (nwritten==0) {
+				zynlog(ZYNCODER_ERR_OUTPUT_BUFFER_FULL, size);
+				jack_ringbuffer_read_advance(jack_sysex_queue, sizeof(size)+size);
+				continue;
+			}
+			break;
+		}
+		buffer = jack_midi_event_reserve(output_port_buffer, jack_out_last_time, size);
+		if (buffer==NULL) break;
+		jack_ringbuffer_read_advance(jack_sysex_queue, sizeof(size));
+		jack_ringbuffer_read(jack_sysex_queue, (char *)buffer, size);
+		if (zynmidi_sysex_rate>0) zynmidi_sysex_credit-=size*sample_rate;
+		nwritten++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Scheduled MIDI events => timer wheel owned by jack thread
+//-----------------------------------------------------------------------------
+
+//Senders claim a preallocated entry (bitmap) and pass it to jack thread through the command
+//queue. Handles => sequence number << ZYNMIDI_SCHEDULE_BITS | entry index
+
+#if (ZYNMIDI_SCHEDULE_SIZE & (ZYNMIDI_SCHEDULE_SIZE-1))!=0 || ZYNMIDI_SCHEDULE_SIZE<64 || ZYNMIDI_SCHEDULE_SIZE>32768
+#error "ZYNMIDI_SCHEDULE_SIZE must be a power of two between 64 and 32768"
+#endif
+#define ZYNMIDI_SCHEDULE_BITS __builtin_ctz(ZYNMIDI_SCHEDULE_SIZE)
+#define ZYNMIDI_SCHEDULE_NIL 0xFFFF
+//Wheel => 256 buckets of 64 frames
+#define SCHEDULE_WHEEL_SIZE 256
+#define SCHEDULE_WHEEL_SHIFT 6
+
+enum zynmidi_schedule_cmd_enum {
+	SCHEDULE_ADD=0,
+	SCHEDULE_CANCEL
+};
+
+struct zynmidi_schedule_cmd_st {
+	uint32_t handle;
+	uint32_t cmd;
+};
+
+struct zynmidi_schedule_entry_st {
+	//Written by senders when claimed, compared by jack thread when canceling
+	atomic_uint handle;
+	jack_nframes_t time;
+	uint8_t size;
+	uint8_t data[3];
+	//Used by jack thread only
+	uint8_t scheduled;
+	uint16_t next;
+	uint16_t prev;
+	uint16_t bucket;
+};
+
+struct zynmidi_schedule_entry_st zynmidi_schedule_entries[ZYNMIDI_SCHEDULE_SIZE];
+atomic_ullong zynmidi_schedule_used[ZYNMIDI_SCHEDULE_SIZE/64];
+atomic_uint zynmidi_schedule_seq;
+struct zynqueue_st zynmidi_schedule_queue;
+uint16_t zynmidi_schedule_wheel[SCHEDULE_WHEEL_SIZE];
+//First bucket (absolute) not fully drained yet => buckets skipped by xruns are drained later
+jack_nframes_t zynmidi_schedule_next_bucket;
+
+int init_zynmidi_schedule() {
+	int i;
+	for (i=0;i<ZYNMIDI_SCHEDULE_SIZE/64;i++) atomic_init(&zynmidi_schedule_used[i],0);
+	for (i=0;i<SCHEDULE_WHEEL_SIZE;i++) zynmidi_schedule_wheel[i]=ZYNMIDI_SCHEDULE_NIL;
+	atomic_init(&zynmidi_schedule_seq,0);
+	memset(zynmidi_schedule_entries,0,sizeof(zynmidi_schedule_entries));
+	for (i=0;i<ZYNMIDI_SCHEDULE_SIZE;i++) atomic_init(&zynmidi_schedule_entries[i].handle,0);
+	zynmidi_schedule_next_bucket=0;
+	return zynqueue_init(&zynmidi_schedule_queue, ZYNMIDI_SCHEDULE_SIZE, sizeof(struct zynmidi_schedule_cmd_st));
+}
+
+void end_zynmidi_schedule() {
+	zynqueue_free(&zynmidi_schedule_queue);
+}
+
+//Claim a free entry => returns its index or -1 if all are used
+int claim_zynmidi_schedule_entry() {
+	int i;
+	for (i=0;i<ZYNMIDI_SCHEDULE_SIZE/64;i++) {
+		unsigned long long used=atomic_load(&zynmidi_schedule_used[i]);
+		while (~used) {
+			int bit=__builtin_ctzll(~used);
+			if (atomic_compare_exchange_weak(&zynmidi_schedule_used[i],&used,used | (1ULL << bit))) return i*64+bit;
+		}
+	}
+	return -1;
+}
+
+void release_zynmidi_schedule_entry(int i) {
+	atomic_fetch_and(&zynmidi_schedule_used[i/64],~(1ULL << (i%64)));
+}
+
+void unlink_zynmidi_schedule_entry(struct zynmidi_schedule_entry_st *entry) {
+	if (entry->prev!=ZYNMIDI_SCHEDULE_NIL) zynmidi_schedule_entries[entry->prev].next=entry->next;
+	else zynmidi_schedule_wheel[entry->bucket]=entry->next;
+	if (entry->next!=ZYNMIDI_SCHEDULE_NIL) zynmidi_schedule_entries[entry->next].prev=entry->prev;
+	entry->scheduled=0;
+}
+
+//Apply commands from senders. Events in the past are moved to the start of this cycle.
+void jack_schedule_commands() {
+	struct zynmidi_schedule_cmd_st cmd;
+	while (zynqueue_pop(&zynmidi_schedule_queue, &cmd)) {
+		int i=cmd.handle & (ZYNMIDI_SCHEDULE_SIZE-1);
+		struct zynmidi_schedule_entry_st *entry=zynmidi_schedule_entries+i;
+		if (cmd.cmd==SCHEDULE_ADD) {
+			if ((int32_t)(entry->time-jack_out_cycle_start)<0) entry->time=jack_out_cycle_start;
+			entry->bucket=(entry->time >> SCHEDULE_WHEEL_SHIFT) & (SCHEDULE_WHEEL_SIZE-1);
+			entry->prev=ZYNMIDI_SCHEDULE_NIL;
+			entry->next=zynmidi_schedule_wheel[entry->bucket];
+			if (entry->next!=ZYNMIDI_SCHEDULE_NIL) zynmidi_schedule_entries[entry->next].prev=i;
+			zynmidi_schedule_wheel[entry->bucket]=i;
+			entry->scheduled=1;
+		} else if (atomic_load_explicit(&entry->handle,memory_order_acquire)==cmd.handle && entry->scheduled) {
+			unlink_zynmidi_schedule_entry(entry);
+			release_zynmidi_schedule_entry(i);
+		}
+	}
+}
+
+//Stage scheduled events due in this cycle, at their exact frame offset. Buckets from the last
+//one drained are visited too, so events skipped by an xrun or a period jump are sent late,
+//at the start of this cycle.
+void jack_out_scheduled(jack_nframes_t nframes) {
+	jack_schedule_commands();
+	jack_nframes_t b0=zynmidi_schedule_next_bucket;
+	jack_nframes_t b1=(jack_out_cycle_start+nframes-1) >> SCHEDULE_WHEEL_SHIFT;
+	//Not started yet or too far => every bucket once
+	if ((int32_t)(b1-b0)<0 || b1-b0>=SCHEDULE_WHEEL_SIZE) b0=b1-(SCHEDULE_WHEEL_SIZE-1);
+	jack_nframes_t nb=b1-b0+1;
+	//Last bucket can hold events for the next cycle => it's visited again
+	zynmidi_schedule_next_bucket=b1;
+	jack_nframes_t b;
+	for (b=0;b<nb;b++) {
+		uint16_t i=zynmidi_schedule_wheel[(b0+b) & (SCHEDULE_WHEEL_SIZE-1)];
+		while (i!=ZYNMIDI_SCHEDULE_NIL) {
+			struct zynmidi_schedule_entry_st *entry=zynmidi_schedule_entries+i;
+			uint16_t next=entry->next;
+			//Entries for next wheel turns stay in the bucket
+			int32_t offset=(int32_t)(entry->time-jack_out_cycle_start);
+			if (offset<(int32_t)nframes) {
+				if (offset<0) offset=0;
+				if (entry->data[0]>=0xF8) jack_out_realtime(offset,entry->data[0]);
+				else jack_out_event(offset,entry->data,entry->size);
+				unlink_zynmidi_schedule_entry(entry);
+				release_zynmidi_schedule_entry(i);
+			}
+			i=next;
+		}
+	}
+}
+
+//Update zyncoders bound to a MIDI controller, using the CC reverse index
+void update_zyncoders_midi_ctrl(uint8_t chan, uint8_t num, uint8_t val) {
 	int j;
+	zyncoder_mask_t zyncoder_mask=zyncoder_midi_ctrl_map[chan][num];
+	for (j=0;zyncoder_mask;j++,zyncoder_mask>>=1) {
+		if (zyncoder_mask & 0x1) {
+			zyncoders[j].value=val;
+			zyncoders[j].subvalue=val*ZYNCODER_TICKS_PER_RETENT;
+		}
+	}
+}
+
+//Forward an input event untouched, for pristine channels
+void jack_forward_event(jack_midi_event_t *ev) {
+	uint8_t event_type=ev->buffer[0] >> 4;
+	//Capture events for GUI => [Control-Change, Note-Off, Note-On, Program-Change]
+	if (event_type==CTRL_CHANGE) {
+		write_zynmidi((ev->buffer[0]<<16)|(ev->buffer[1]<<8)|(ev->buffer[2]));
+		update_zyncoders_midi_ctrl(ev->buffer[0] & 0xF,ev->buffer[1] & 0x7F,ev->buffer[2] & 0x7F);
+	} else if (event_type==NOTE_OFF || event_type==NOTE_ON || event_type==PROG_CHANGE) {
+		write_zynmidi((ev->buffer[0]<<16)|(ev->buffer[1]<<8)|(ev->buffer[2]));
+	}
+	jack_out_event(ev->time,ev->buffer,ev->size);
+}
+
+//Whole filter is pristine => forward the input buffer in one pass
+void jack_forward_input(void *input_port_buffer, jack_nframes_t nframes) {
+	int i;
+	jack_midi_event_t ev;
+	int nev=jack_midi_get_event_count(input_port_buffer);
+	if (nev>nframes) {
+		zynlog(ZYNCODER_ERR_INPUT_TOO_MANY_EVENTS, nev);
+		nev=nframes;
+	}
+	for (i=0;i<nev;i++) {
+		jack_midi_event_get(&ev, input_port_buffer, i);
+		//System realtime messages => priority lane
+		if (ev.buffer[0]>=0xF8) jack_out_realtime(ev.time,ev.buffer[0]);
+		//SysEx messages are forwarded without copying
+		else if (ev.buffer[0]==SYSTEM_EXCLUSIVE) jack_out_event_ref(ev.time,ev.buffer,ev.size);
+		else {
+			jack_select_midi_filter_preset(&ev);
+			jack_forward_event(&ev);
+		}
+	}
+}
+
+//Process input events through the MIDI filter
+void jack_filter_input(struct midi_filter_st *mf, void *input_port_buffer, jack_nframes_t nframes) {
+	int i;
 	uint8_t event_type;
 	uint8_t event_chan;
 	uint8_t event_num;
 	uint8_t event_val;
-	uint8_t event_size;
-	uint8_t *buffer;
+	jack_midi_event_t ev;
 
-	//---------------------------------
-	//MIDI Input
-	//---------------------------------
+	for (i=0;jack_midi_event_get(&ev, input_port_buffer, i)==0;i++) {
+		if (i>nframes) {
+			zynlog(ZYNCODER_ERR_INPUT_TOO_MANY_EVENTS, i);
+			break;
+		}
 
-	//Read jackd data buffer
-	void *input_port_buffer = jack_port_get_buffer(jack_midi_input_port, nframes);
-	if (input_port_buffer==NULL) {
-		fprintf (stderr, "Zyncoder: Error allocating jack input port buffer: %d frames\n", nframes);
-		return -1;
-	}
-	//Process MIDI messages
-	jack_midi_event_t ev;
-	while (jack_midi_event_get(&ev, input_port_buffer, i)==0) {
-		//Ignore SysEx messages
-		if (ev.buffer[0]==SYSTEM_EXCLUSIVE) continue;
+		//System realtime messages => priority lane
+		if (ev.buffer[0]>=0xF8) {
+			jack_out_realtime(ev.time,ev.buffer[0]);
+			continue;
+		}
+
+		//SysEx messages are forwarded without copying
+		if (ev.buffer[0]==SYSTEM_EXCLUSIVE) {
+			jack_out_event_ref(ev.time,ev.buffer,ev.size);
+			continue;
+		}
+
+		//Program Change on the presets channel => switch filter preset
+		jack_select_midi_filter_preset(&ev);
+
+		//Pristine channel => forward untouched
+		if (mf->pristine_chans[(ev.buffer[0] >> 4) & 0x7] & (1 << (ev.buffer[0] & 0xF))) {
+			jack_forward_event(&ev);
+			continue;
+		}
 
 		event_type=ev.buffer[0] >> 4;
 		event_chan=ev.buffer[0] & 0xF;
@@ -686,28 +2460,29 @@ int jack_process(jack_nframes_t nframes, void *arg) {
 			write_zynmidi((ev.buffer[0]<<16)|(ev.buffer[1]<<8)|(ev.buffer[2]));
 		}
 
-		//Event Mapping
-		struct midi_event_st *event_map=&midi_filter.event_map[event_type & 0x7][event_chan][event_num];
+		//Event Mapping => packed entry
+		uint16_t event_map=mf->event_map_packed[event_type & 0x7][event_chan][event_num];
+		int event_map_type=MF_PACKED_TYPE(event_map);
 		//Ignore event...
-		if (event_map->type==IGNORE_EVENT)
+		if (event_map_type==IGNORE_EVENT)
 			continue;
 		//Map event ...
-		if (event_map->type>=0 || event_map->type==SWAP_EVENT) {
+		if (event_map_type>=0 || event_map_type==SWAP_EVENT) {
 			//fprintf (stdout, "Zyncoder: Event Map %d, %d => ",ev.buffer[0],ev.buffer[1]);
-			if (event_map->type!=SWAP_EVENT) event_type=event_map->type;
-			event_chan=event_map->chan;
+			if (event_map_type!=SWAP_EVENT) event_type=event_map_type;
+			event_chan=MF_PACKED_CHAN(event_map);
 			ev.buffer[0]=(event_type << 4) | event_chan;
-			if (event_map->type==PROG_CHANGE || event_map->type==CHAN_PRESS) {
+			if (event_map_type==PROG_CHANGE || event_map_type==CHAN_PRESS) {
 				event_num=0;
 				ev.buffer[1]=event_val;
 				ev.size=2;
-			} else if (event_map->type==PITCH_BENDING) {
+			} else if (event_map_type==PITCH_BENDING) {
 				event_num=0;
 				ev.buffer[1]=0;
 				ev.buffer[2]=event_val;
 				ev.size=3;
 			} else {
-				event_num=event_map->num;
+				event_num=MF_PACKED_NUM(event_map);
 				ev.buffer[1]=event_num;
 				ev.buffer[2]=event_val;
 				ev.size=3;
@@ -717,44 +2492,37 @@ int jack_process(jack_nframes_t nframes, void *arg) {
 
 		//MIDI CC messages
 		if (event_type==CTRL_CHANGE) {
-			//Update Zyncoder value => TODO Optimize this fragment!!!
-			for (j=0;j<MAX_NUM_ZYNCODERS;j++) {
-				if (zyncoders[j].enabled && zyncoders[j].midi_chan==event_chan && zyncoders[j].midi_ctrl==event_num) {
-					zyncoders[j].value=event_val;
-					zyncoders[j].subvalue=event_val*ZYNCODER_TICKS_PER_RETENT;
-				}
-			}
+			update_zyncoders_midi_ctrl(event_chan,event_num,event_val);
 		}
 		//Note-on/off messages
 		else if (event_type==NOTE_OFF || event_type==NOTE_ON) {
 			//Transpose
-			if (midi_filter.transpose[event_chan]!=0) {
-				int note=ev.buffer[1]+midi_filter.transpose[event_chan];
+			if (mf->transpose[event_chan]!=0) {
+				int note=ev.buffer[1]+mf->transpose[event_chan];
 				//If transposed note is out of range, ignore message ...
-				if (note>0x7F || note<0) {
-					i++;
-					continue;
-				}
+				if (note>0x7F || note<0) continue;
 				ev.buffer[1]=(uint8_t)(note & 0x7F);
 			}
 		}
 
 		// Fine-Tuning, using pitch-bending messages ...
-		if (midi_filter.tuning_pitchbend>=0) {
+		if (mf->tuning_pitchbend>=0) {
 			if (event_type==NOTE_ON) {
-				int pb=midi_filter.last_pb_val[event_chan];
-				//printf("NOTE-ON PITCHBEND=%d (%d)\n",pb,midi_filter.tuning_pitchbend);
-				pb=get_tuned_pitchbend(pb);
+				int pb=midi_filter_state.last_pb_val[event_chan];
+				//printf("NOTE-ON PITCHBEND=%d (%d)\n",pb,mf->tuning_pitchbend);
+				pb=get_tuned_pitchbend(mf,pb);
 				//printf("NOTE-ON TUNED PITCHBEND=%d\n",pb);
-				zynmidi_send_pitchbend_change(event_chan,pb);
+				//Send tuned pitchbend at the same frame, just before the note-on
+				uint8_t pb_buffer[3]={ 0xE0 | event_chan, pb & 0x7F, (pb >> 7) & 0x7F };
+				jack_out_event(ev.time,pb_buffer,3);
 			} else if (event_type==PITCH_BENDING) {
 				//Get received PB
 				int pb=(ev.buffer[2] << 7) | ev.buffer[1];
 				//Save last received PB value ...
-				midi_filter.last_pb_val[event_chan]=pb;
+				midi_filter_state.last_pb_val[event_chan]=pb;
 				//Calculate tuned PB
 				//printf("PITCHBEND=%d\n",pb);
-				pb=get_tuned_pitchbend(pb);
+				pb=get_tuned_pitchbend(mf,pb);
 				//printf("TUNED PITCHBEND=%d\n",pb);
 				ev.buffer[1]=pb & 0x7F;
 				ev.buffer[2]=(pb >> 7) & 0x7F;
@@ -766,225 +2534,816 @@ int jack_process(jack_nframes_t nframes, void *arg) {
 			write_zynmidi((ev.buffer[0]<<16)|(ev.buffer[1]<<8)|(ev.buffer[2]));
 		}
 
-		//Forward message
-		jack_write_midi_event(ev.buffer,ev.size);
+		//Forward message, keeping its original frame offset
+		jack_out_event(ev.time,ev.buffer,ev.size);
+	}
 
-		if (i>nframes) {
-			fprintf (stderr, "Zyncoder: Error processing jack midi input events: TOO MANY EVENTS\n");
-			return -1;
-		}
-		i++;
+}
+
+int jack_process(jack_nframes_t nframes, void *arg) {
+	//Frame time at the start of this cycle
+	jack_out_cycle_start=jack_last_frame_time(jack_client);
+
+	//Get jackd data buffers
+	void *input_port_buffer = jack_port_get_buffer(jack_midi_input_port, nframes);
+	void *output_port_buffer = jack_port_get_buffer(jack_midi_output_port, nframes);
+	if (input_port_buffer==NULL || output_port_buffer==NULL) {
+		zynlog(ZYNCODER_ERR_PORT_BUFFER, nframes);
+		return -1;
 	}
+	jack_midi_clear_buffer(output_port_buffer);
+	jack_reset_midi_clock_stats();
+	atomic_store_explicit(&jack_out_max_event_size,jack_midi_max_event_size(output_port_buffer),memory_order_relaxed);
+
+	//Stage realtime messages queued from API calls first, so they always get a slot
+	struct zynmidi_event_st qev;
+	while (zynqueue_pop(&jack_realtime_queue, &qev)) {
+		jack_out_realtime(jack_queued_event_offset(qev.time,nframes),qev.data[0]);
+	}
+
+	//MIDI filter copy used during this cycle
+	struct midi_filter_st *mf=acquire_midi_filter();
+
+	//---------------------------------
+	//MIDI Input
+	//---------------------------------
+
+	if (mf->pristine) jack_forward_input(input_port_buffer, nframes);
+	else jack_filter_input(mf, input_port_buffer, nframes);
 
 	//---------------------------------
 	//MIDI Output
 	//---------------------------------
 
-	//Get internal MIDI data buffer
-	void *output_port_buffer = jack_port_get_buffer(jack_midi_output_port, nframes);
-	if (output_port_buffer==NULL) {
-		fprintf (stderr, "Zyncoder: Error allocating jack output port buffer: %d frames\n", nframes);
+	//Stage changed encoders (pull mode)
+	jack_out_zyncoders();
+
+	//Stage scheduled events due in this cycle
+	jack_out_scheduled(nframes);
+
+	//Stage events queued from encoders & API calls
+	while (zynqueue_pop(&jack_out_queue, &qev)) {
+		jack_nframes_t offset=jack_queued_event_offset(qev.time,nframes);
+
+		/*
+		//Master Channel Control
+		if ((qev.data[0] >> 4)==CTRL_CHANGE) {
+			event_chan=qev.data[0] & 0xF;
+			event_num=qev.data[1] & 0x7F;
+			event_val=qev.data[2] & 0x7F;
+
+			//Save last controller values for Master Channel calculation ...
+			midi_filter_state.last_ctrl_val[event_chan][event_num]=event_val;
+
+			//Captured Controllers => volume
+			if (event_num==0x7) {
+				if (mf->master_chan>=0) {
+					//if channel is master, resend ctrl messages to all normal channels ...
+					if (event_chan==mf->master_chan) {
+						for (j=0;j<16;j++) {
+							if (j==mf->master_chan) continue;
+							zynmidi_send_ccontrol_change(j,event_num,midi_filter_state.last_ctrl_val[j][event_num]);
+						}
+					//if channel is not master, scale value proportionally to Master Channel value ...
+					} else {
+						qev.data[2]=((int32_t)event_val*(uint32_t)midi_filter_state.last_ctrl_val[mf->master_chan][event_num])>>7;
+					}
+				}
+			}
+		}
+		*/
+
+		jack_out_event(offset,qev.data,qev.size);
+	}
+
+	//Write MIDI data
+	int nwritten=jack_out_flush(output_port_buffer);
+	jack_out_sysex(output_port_buffer, nframes, nwritten);
+
+	release_midi_filter();
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// MIDI Send Functions
+//-----------------------------------------------------------------------------
+
+int zynmidi_send_note_off(uint8_t chan, uint8_t note, uint8_t vel) {
+	uint8_t buffer[3];
+	buffer[0] = 0x80 + (chan & 0x0F);
+	buffer[1] = note;
+	buffer[2] = vel;
+	return jack_write_midi_event(buffer,3);
+}
+
+int zynmidi_send_note_on(uint8_t chan, uint8_t note, uint8_t vel) {
+	uint8_t buffer[3];
+	buffer[0] = 0x90 + (chan & 0x0F);
+	buffer[1] = note;
+	buffer[2] = vel;
+	return jack_write_midi_event(buffer,3);
+}
+
+int zynmidi_send_ccontrol_change(uint8_t chan, uint8_t ctrl, uint8_t val) {
+	uint8_t buffer[3];
+	buffer[0] = 0xB0 + (chan & 0x0F);
+	buffer[1] = ctrl;
+	buffer[2] = val;
+	return jack_write_midi_event(buffer,3);
+}
+
+int zynmidi_send_program_change(uint8_t chan, uint8_t prgm) {
+	uint8_t buffer[3];
+	buffer[0] = 0xC0 + (chan & 0x0F);
+	buffer[1] = prgm;
+	buffer[2] = 0;
+	return jack_write_midi_event(buffer,2);
+}
+
+int zynmidi_send_pitchbend_change(uint8_t chan, uint16_t pb) {
+	uint8_t buffer[3];
+	buffer[0] = 0xE0 + (chan & 0x0F);
+	buffer[1] = pb & 0x7F;
+	buffer[2] = (pb >> 7) & 0x7F;
+	return jack_write_midi_event(buffer,3);
+}
+
+//Scheduled events
+
+uint32_t zynmidi_get_frame_time(unsigned int delay_us) {
+	if (!zyngate_enter(&zynmidi_gate)) return 0;
+	uint32_t time=jack_frame_time(jack_client)+(uint64_t)delay_us*jack_get_sample_rate(jack_client)/1000000;
+	zyngate_leave(&zynmidi_gate);
+	return time;
+}
+
+zynmidi_handle_t zynmidi_schedule_event(uint32_t time, uint8_t *data, int size) {
+	if (size<1 || size>3) {
+		fprintf (stderr, "Zyncoder: Bad size (%d) for scheduled MIDI event!\n",size);
+		return 0;
+	}
+	if (!zyngate_enter(&zynmidi_gate)) return 0;
+	int i=claim_zynmidi_schedule_entry();
+	if (i<0) {
+		zyngate_leave(&zynmidi_gate);
+		fprintf (stderr, "Zyncoder: MIDI scheduler is full!\n");
+		return 0;
+	}
+	struct zynmidi_schedule_entry_st *entry=zynmidi_schedule_entries+i;
+	uint32_t seq=atomic_fetch_add(&zynmidi_schedule_seq,1)+1;
+	uint32_t handle=(seq << ZYNMIDI_SCHEDULE_BITS) | i;
+	if (handle==0) handle=(1 << ZYNMIDI_SCHEDULE_BITS) | i;
+	entry->time=time;
+	entry->size=size;
+	memcpy(entry->data,data,size);
+	atomic_store_explicit(&entry->handle,handle,memory_order_release);
+	struct zynmidi_schedule_cmd_st cmd={ .handle=handle, .cmd=SCHEDULE_ADD };
+	int res=zynqueue_push(&zynmidi_schedule_queue, &cmd);
+	zyngate_leave(&zynmidi_gate);
+	if (res) {
+		release_zynmidi_schedule_entry(i);
+		fprintf (stderr, "Zyncoder: MIDI scheduler queue is full!\n");
+		return 0;
+	}
+	return cmd.handle;
+}
+
+int zynmidi_cancel_event(zynmidi_handle_t handle) {
+	if (handle==0) return -1;
+	//Entry released or reused => already sent or canceled
+	int i=handle & (ZYNMIDI_SCHEDULE_SIZE-1);
+	if (!(atomic_load(&zynmidi_schedule_used[i/64]) & (1ULL << (i%64))) || atomic_load_explicit(&zynmidi_schedule_entries[i].handle,memory_order_acquire)!=handle) return 1;
+	struct zynmidi_schedule_cmd_st cmd={ .handle=handle, .cmd=SCHEDULE_CANCEL };
+	if (!zyngate_enter(&zynmidi_gate)) return -1;
+	int res=zynqueue_push(&zynmidi_schedule_queue, &cmd);
+	zyngate_leave(&zynmidi_gate);
+	return res;
+}
+
+zynmidi_handle_t zynmidi_schedule_note_off(uint32_t time, uint8_t chan, uint8_t note, uint8_t vel) {
+	uint8_t buffer[3];
+	buffer[0] = 0x80 + (chan & 0x0F);
+	buffer[1] = note;
+	buffer[2] = vel;
+	return zynmidi_schedule_event(time,buffer,3);
+}
+
+zynmidi_handle_t zynmidi_schedule_note_on(uint32_t time, uint8_t chan, uint8_t note, uint8_t vel) {
+	uint8_t buffer[3];
+	buffer[0] = 0x90 + (chan & 0x0F);
+	buffer[1] = note;
+	buffer[2] = vel;
+	return zynmidi_schedule_event(time,buffer,3);
+}
+
+zynmidi_handle_t zynmidi_schedule_ccontrol_change(uint32_t time, uint8_t chan, uint8_t ctrl, uint8_t val) {
+	uint8_t buffer[3];
+	buffer[0] = 0xB0 + (chan & 0x0F);
+	buffer[1] = ctrl;
+	buffer[2] = val;
+	return zynmidi_schedule_event(time,buffer,3);
+}
+
+zynmidi_handle_t zynmidi_schedule_program_change(uint32_t time, uint8_t chan, uint8_t prgm) {
+	uint8_t buffer[2];
+	buffer[0] = 0xC0 + (chan & 0x0F);
+	buffer[1] = prgm;
+	return zynmidi_schedule_event(time,buffer,2);
+}
+
+zynmidi_handle_t zynmidi_schedule_pitchbend_change(uint32_t time, uint8_t chan, uint16_t pb) {
+	uint8_t buffer[3];
+	buffer[0] = 0xE0 + (chan & 0x0F);
+	buffer[1] = pb & 0x7F;
+	buffer[2] = (pb >> 7) & 0x7F;
+	return zynmidi_schedule_event(time,buffer,3);
+}
+
+//Copy data at offset "pos" of a ringbuffer write vector, without advancing the write pointer
+void write_ringbuffer_vector(jack_ringbuffer_data_t *vec, size_t pos, uint8_t *data, size_t size) {
+	size_t n=0;
+	if (pos<vec[0].len) {
+		n=vec[0].len-pos;
+		if (n>size) n=size;
+		memcpy(vec[0].buf+pos, data, n);
+		pos=vec[0].len;
+	}
+	if (size>n) memcpy(vec[1].buf+pos-vec[0].len, data+n, size-n);
+}
+
+int zynmidi_send_sysex(uint8_t *data, int size) {
+	uint32_t sz=size;
+	if (size<2 || data[0]!=SYSTEM_EXCLUSIVE || data[size-1]!=0xF7) {
+		fprintf (stderr, "Zyncoder: Bad SysEx message (%d bytes)\n", size);
+		return -1;
+	}
+	//Until jack thread has run a cycle, the output buffer size is unknown
+	size_t max_size=atomic_load_explicit(&jack_out_max_event_size,memory_order_relaxed);
+	if (sz+sizeof(sz)>ZYNMIDI_SYSEX_QUEUE_SIZE || (max_size>0 && sz>max_size)) {
+		fprintf (stderr, "Zyncoder: SysEx message is too long (%d bytes)\n", size);
+		return -1;
+	}
+	if (!zyngate_enter(&zynmidi_gate)) return -1;
+	pthread_mutex_lock(&jack_sysex_queue_mutex);
+	if (jack_ringbuffer_write_space(jack_sysex_queue)<sz+sizeof(sz)) {
+		pthread_mutex_unlock(&jack_sysex_queue_mutex);
+		zyngate_leave(&zynmidi_gate);
+		return -1;
+	}
+	//The reader sees the header only after the full message has been written
+	jack_ringbuffer_data_t vec[2];
+	jack_ringbuffer_get_write_vector(jack_sysex_queue, vec);
+	write_ringbuffer_vector(vec, 0, (uint8_t *)&sz, sizeof(sz));
+	write_ringbuffer_vector(vec, sizeof(sz), data, sz);
+	jack_ringbuffer_write_advance(jack_sysex_queue, sizeof(sz)+sz);
+	pthread_mutex_unlock(&jack_sysex_queue_mutex);
+	zyngate_leave(&zynmidi_gate);
+	return 0;
+}
+
+void set_zynmidi_sysex_rate(unsigned int bytes_per_second) {
+	zynmidi_sysex_rate=bytes_per_second;
+}
+
+int zynmidi_send_master_ccontrol_change(uint8_t ctrl, uint8_t val) {
+	struct midi_filter_st *mf=view_midi_filter();
+	if (mf->master_chan>=0) {
+		return zynmidi_send_ccontrol_change(mf->master_chan, ctrl, val);
+	}
+}
+
+
+//Monotonic time in us => same clock as the GPIO chardev event timestamps
+unsigned long get_zyncoder_tsus() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+#ifndef MCP23017_ENCODERS
+//-----------------------------------------------------------------------------
+// GPIO backends
+//-----------------------------------------------------------------------------
+
+void update_zynswitch_state(uint8_t i, uint8_t status, unsigned long tsus);
+void update_zyncoder_state(uint8_t i, uint8_t MSB, uint8_t LSB, unsigned long tsus);
+void update_zynswitch(uint8_t i);
+void update_zyncoder(uint8_t i);
+
+struct zyncoder_gpio_backend_st {
+	const char *name;
+	int (*init)(const char *device);
+	void (*end)();
+	//Input with pull-up, reporting edges to update_gpio_pin/update_gpio_pin_event
+	int (*setup_pin)(uint8_t pin);
+	int (*read_pin)(uint8_t pin);
+};
+
+//Native GPIO pin => zyncoder/zynswitch index
+#define MAP_NONE 0
+#define MAP_ZYNCODER 1
+#define MAP_ZYNSWITCH 2
+struct zyncoder_gpio_map_st {
+	uint8_t type;
+	uint8_t index;
+};
+struct zyncoder_gpio_map_st zyncoder_gpio_map[ZYNCODER_GPIO_MAX_PINS];
+
+//Pin edge with its value & timestamp => events from the chardev & sim backends
+void update_gpio_pin_event(uint8_t pin, uint8_t value, unsigned long tsus) {
+	if (pin>=ZYNCODER_GPIO_MAX_PINS) return;
+	struct zyncoder_gpio_map_st *map = zyncoder_gpio_map + pin;
+	if (map->type==MAP_ZYNCODER) {
+		struct zyncoder_st *zyncoder = zyncoders + map->index;
+		if (pin==zyncoder->pin_a) zyncoder->pin_a_last_state=value;
+		else zyncoder->pin_b_last_state=value;
+		update_zyncoder_state(map->index, zyncoder->pin_a_last_state, zyncoder->pin_b_last_state, tsus);
+	} else if (map->type==MAP_ZYNSWITCH) {
+		update_zynswitch_state(map->index, value, tsus);
+	}
+}
+
+//Pin edge without value => wiringPi ISRs read the pins after waking up
+void update_gpio_pin(uint8_t pin) {
+	struct zyncoder_gpio_map_st *map = zyncoder_gpio_map + pin;
+	if (map->type==MAP_ZYNCODER) update_zyncoder(map->index);
+	else if (map->type==MAP_ZYNSWITCH) update_zynswitch(map->index);
+}
+
+//wiringPi (or wiringPiEmu) backend
+ISR_TRAMPOLINES(update_gpio_pin)
+
+int wiringpi_gpio_init(const char *device) {
+	return 0;
+}
+
+void wiringpi_gpio_end() {
+}
+
+int wiringpi_gpio_setup_pin(uint8_t pin) {
+	static uint8_t isr_set[ZYNCODER_GPIO_MAX_PINS];
+	pinMode(pin, INPUT);
+	pullUpDnControl(pin, PUD_UP);
+	if (isr_set[pin]) return 0;
+	isr_set[pin]=1;
+	return wiringPiISR(pin, INT_EDGE_BOTH, update_gpio_pin_isrs[pin]) < 0 ? -1 : 0;
+}
+
+int wiringpi_gpio_read_pin(uint8_t pin) {
+	return digitalRead(pin);
+}
+
+#ifdef HAVE_GPIO_CHARDEV
+//Linux GPIO character device backend => a line request per pin, with edge detection &
+//kernel timestamps (CLOCK_MONOTONIC). A thread reads the events in batches.
+//Lines have their own event buffers in the kernel => the thread merges them by timestamp,
+//so the A & B edges of an encoder are decoded in the order they happened, even when it
+//falls behind.
+#define GPIO_CHARDEV_EVENTS_BATCH 16
+struct gpio_chardev_line_st {
+	struct gpio_v2_line_event events[GPIO_CHARDEV_EVENTS_BATCH];
+	int n, pos;
+	//Last read finding no events (ns, monotonic clock) => newer events only
+	uint64_t empty_ns;
+	uint32_t seqno;
+};
+struct gpio_chardev_st {
+	int chip_fd;
+	int line_fds[ZYNCODER_GPIO_MAX_PINS];
+	int wake_pipe[2];
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct gpio_chardev_line_st lines[ZYNCODER_GPIO_MAX_PINS];
+};
+struct gpio_chardev_st gpio_chardev={ .chip_fd=-1, .lock=PTHREAD_MUTEX_INITIALIZER };
+
+//Read the next batch of events of a line (non-blocking). Returns the number of events.
+int gpio_chardev_read_line(uint8_t pin) {
+	struct gpio_chardev_line_st *line=gpio_chardev.lines+pin;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int n=read(gpio_chardev.line_fds[pin], line->events, sizeof(line->events));
+	line->pos=0;
+	line->n=n>0 ? n/sizeof(struct gpio_v2_line_event) : 0;
+	if (line->n==0) line->empty_ns=ts.tv_sec*1000000000ULL + ts.tv_nsec;
+	return line->n;
+}
+
+//Dispatch the pending events of all lines, oldest first
+void gpio_chardev_dispatch(uint8_t *pins, int npins) {
+	int i, best, again;
+	for (i=0;i<npins;i++) {
+		struct gpio_chardev_line_st *line=gpio_chardev.lines+pins[i];
+		if (line->pos>=line->n) gpio_chardev_read_line(pins[i]);
+	}
+	while (1) {
+		best=-1;
+		for (i=0;i<npins;i++) {
+			struct gpio_chardev_line_st *line=gpio_chardev.lines+pins[i];
+			if (line->pos>=line->n) continue;
+			if (best<0 || line->events[line->pos].timestamp_ns<gpio_chardev.lines[best].events[gpio_chardev.lines[best].pos].timestamp_ns) best=pins[i];
+		}
+		if (best<0) break;
+		struct gpio_chardev_line_st *line=gpio_chardev.lines+best;
+		struct gpio_v2_line_event *event=line->events+line->pos;
+		//Lines found empty before this event may have older ones by now
+		again=0;
+		for (i=0;i<npins;i++) {
+			struct gpio_chardev_line_st *other=gpio_chardev.lines+pins[i];
+			if (other->pos>=other->n && other->empty_ns<event->timestamp_ns && gpio_chardev_read_line(pins[i])>0) again=1;
+		}
+		if (again) continue;
+		//Kernel sequence numbers => events dropped by a full kernel buffer
+		if (line->seqno>0 && event->line_seqno!=line->seqno+1) zynlog(ZYNCODER_ERR_GPIO_EVENTS_LOST, best);
+		line->seqno=event->line_seqno;
+		update_gpio_pin_event(best, event->id==GPIO_V2_LINE_EVENT_RISING_EDGE, event->timestamp_ns/1000);
+		if (++line->pos>=line->n) gpio_chardev_read_line(best);
+	}
+}
+
+void * gpio_chardev_thread(void *arg) {
+	struct pollfd pfds[ZYNCODER_GPIO_MAX_PINS+1];
+	uint8_t pins[ZYNCODER_GPIO_MAX_PINS];
+	int i, nfds;
+	while (1) {
+		//Rebuild the poll set => it changes when pins are set up
+		pfds[0].fd=gpio_chardev.wake_pipe[0];
+		pfds[0].events=POLLIN;
+		nfds=1;
+		pthread_mutex_lock(&gpio_chardev.lock);
+		for (i=0;i<ZYNCODER_GPIO_MAX_PINS;i++) {
+			if (gpio_chardev.line_fds[i]<0) continue;
+			pfds[nfds].fd=gpio_chardev.line_fds[i];
+			pfds[nfds].events=POLLIN;
+			pins[nfds-1]=i;
+			nfds++;
+		}
+		pthread_mutex_unlock(&gpio_chardev.lock);
+
+		if (poll(pfds, nfds, -1)<0) continue;
+		if (pfds[0].revents & POLLIN) {
+			char c=0;
+			if (read(gpio_chardev.wake_pipe[0], &c, 1)==1 && c=='q') break;
+		}
+		gpio_chardev_dispatch(pins, nfds-1);
+	}
+	return NULL;
+}
+
+int gpio_chardev_init(const char *device) {
+	int i;
+	if (device==NULL) device="/dev/gpiochip0";
+	for (i=0;i<ZYNCODER_GPIO_MAX_PINS;i++) gpio_chardev.line_fds[i]=-1;
+	memset(gpio_chardev.lines, 0, sizeof(gpio_chardev.lines));
+	gpio_chardev.chip_fd=open(device, O_RDONLY | O_CLOEXEC);
+	if (gpio_chardev.chip_fd<0) {
+		fprintf (stderr, "Zyncoder: Can't open GPIO chardev %s!\n", device);
 		return -1;
 	}
-	jack_midi_clear_buffer(output_port_buffer);
-	int nb=jack_ringbuffer_read_space(jack_ring_output_buffer);
-	if (jack_ringbuffer_read(jack_ring_output_buffer, jack_midi_data, nb)!=nb) {
-		fprintf (stderr, "Zyncoder: Error reading midi data from jack ring output buffer: %d bytes\n", nb);
+	if (pipe(gpio_chardev.wake_pipe)<0 || pthread_create(&gpio_chardev.thread, NULL, &gpio_chardev_thread, NULL)!=0) {
+		fprintf (stderr, "Zyncoder: Can't create GPIO chardev thread!\n");
+		close(gpio_chardev.chip_fd);
+		gpio_chardev.chip_fd=-1;
 		return -1;
 	}
+	return 0;
+}
 
-	//Write MIDI data
-	int pos=0;
-	i=0;
-	while (pos < nb) {
-		event_type= jack_midi_data[pos] >> 4;
-
-		if (jack_midi_data[pos]>=0xF4) event_size=1;
-		else if (event_type==PROG_CHANGE || event_type==CHAN_PRESS || event_type==TIME_CODE_QF || event_type==SONG_SELECT) event_size=2;
-		else event_size=3;
+void gpio_chardev_end() {
+	int i;
+	if (gpio_chardev.chip_fd<0) return;
+	char c='q';
+	if (write(gpio_chardev.wake_pipe[1], &c, 1)==1) pthread_join(gpio_chardev.thread, NULL);
+	for (i=0;i<ZYNCODER_GPIO_MAX_PINS;i++) {
+		if (gpio_chardev.line_fds[i]>=0) close(gpio_chardev.line_fds[i]);
+		gpio_chardev.line_fds[i]=-1;
+	}
+	close(gpio_chardev.wake_pipe[0]);
+	close(gpio_chardev.wake_pipe[1]);
+	close(gpio_chardev.chip_fd);
+	gpio_chardev.chip_fd=-1;
+}
 
-		/*
-		//Master Channel Control
-		if (event_type==CTRL_CHANGE) {
-			event_chan=jack_midi_data[pos] & 0xF;
-			event_num=jack_midi_data[pos+1] & 0x7F;
-			event_val=jack_midi_data[pos+2] & 0x7F;
+int gpio_chardev_setup_pin(uint8_t pin) {
+	//Lines are requested once & kept until the end
+	if (gpio_chardev.line_fds[pin]>=0) return 0;
+	struct gpio_v2_line_request req;
+	memset(&req, 0, sizeof(req));
+	req.offsets[0]=pin;
+	req.num_lines=1;
+	strcpy(req.consumer, "zyncoder");
+	req.config.flags=GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP |
+		GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	req.event_buffer_size=64;
+	if (ioctl(gpio_chardev.chip_fd, GPIO_V2_GET_LINE_IOCTL, &req)<0) {
+		fprintf (stderr, "Zyncoder: Can't request GPIO line %d!\n", pin);
+		return -1;
+	}
+	//Lines are drained until empty => non-blocking reads
+	fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+	pthread_mutex_lock(&gpio_chardev.lock);
+	gpio_chardev.line_fds[pin]=req.fd;
+	pthread_mutex_unlock(&gpio_chardev.lock);
+	char c='w';
+	if (write(gpio_chardev.wake_pipe[1], &c, 1)!=1) return -1;
+	return 0;
+}
 
-			//Save last controller values for Master Channel calculation ...
-			midi_filter.last_ctrl_val[event_chan][event_num]=event_val;
+int gpio_chardev_read_pin(uint8_t pin) {
+	struct gpio_v2_line_values values={ .bits=0, .mask=1 };
+	if (gpio_chardev.line_fds[pin]<0) return 0;
+	if (ioctl(gpio_chardev.line_fds[pin], GPIO_V2_LINE_GET_VALUES_IOCTL, &values)<0) return 0;
+	return values.bits & 0x01;
+}
+#endif
 
-			//Captured Controllers => volume
-			if (event_num==0x7) {
-				if (midi_filter.master_chan>=0) {
-					//if channel is master, resend ctrl messages to all normal channels ...
-					if (event_chan==midi_filter.master_chan) {
-						for (j=0;j<16;j++) {
-							if (j==midi_filter.master_chan) continue;
-							zynmidi_send_ccontrol_change(j,event_num,midi_filter.last_ctrl_val[j][event_num]);
-						}
-					//if channel is not master, scale value proportionally to Master Channel value ...
-					} else {
-						jack_midi_data[pos+2]=((int32_t)event_val*(uint32_t)midi_filter.last_ctrl_val[midi_filter.master_chan][event_num])>>7;
-					}
-				}
-			}
-		}
-		*/
+//Simulated backend => pins are pulled up, edges are injected with set_zyncoder_gpio_sim_pin
+uint8_t gpio_sim_values[ZYNCODER_GPIO_MAX_PINS];
 
-		//Write to Jackd buffer
-		buffer = jack_midi_event_reserve(output_port_buffer, i, event_size);
-		memcpy(buffer, jack_midi_data+pos, event_size);
-		pos+=event_size;
+int gpio_sim_init(const char *device) {
+	memset(gpio_sim_values, 1, sizeof(gpio_sim_values));
+	return 0;
+}
 
-		if (i>nframes) {
-			fprintf (stderr, "Zyncoder: Error processing jack midi output events: TOO MANY EVENTS\n");
-			return -1;
-		}
-		i++;
-	}
+void gpio_sim_end() {
+}
 
+int gpio_sim_setup_pin(uint8_t pin) {
 	return 0;
 }
 
-//-----------------------------------------------------------------------------
-// MIDI Send Functions
-//-----------------------------------------------------------------------------
-
-int zynmidi_send_note_off(uint8_t chan, uint8_t note, uint8_t vel) {
-	uint8_t buffer[3];
-	buffer[0] = 0x80 + (chan & 0x0F);
-	buffer[1] = note;
-	buffer[2] = vel;
-	return jack_write_midi_event(buffer,3);
+int gpio_sim_read_pin(uint8_t pin) {
+	return gpio_sim_values[pin];
 }
 
-int zynmidi_send_note_on(uint8_t chan, uint8_t note, uint8_t vel) {
-	uint8_t buffer[3];
-	buffer[0] = 0x90 + (chan & 0x0F);
-	buffer[1] = note;
-	buffer[2] = vel;
-	return jack_write_midi_event(buffer,3);
+void set_zyncoder_gpio_sim_pin(uint8_t pin, uint8_t value, unsigned long tsus) {
+	if (pin>=ZYNCODER_GPIO_MAX_PINS) return;
+	value=(value!=0);
+	if (gpio_sim_values[pin]==value) return;
+	gpio_sim_values[pin]=value;
+	if (tsus==0) tsus=get_zyncoder_tsus();
+	update_gpio_pin_event(pin, value, tsus);
 }
 
-int zynmidi_send_ccontrol_change(uint8_t chan, uint8_t ctrl, uint8_t val) {
-	uint8_t buffer[3];
-	buffer[0] = 0xB0 + (chan & 0x0F);
-	buffer[1] = ctrl;
-	buffer[2] = val;
-	return jack_write_midi_event(buffer,3);
+struct zyncoder_gpio_backend_st zyncoder_gpio_backends[]={
+	{ "wiringpi", wiringpi_gpio_init, wiringpi_gpio_end, wiringpi_gpio_setup_pin, wiringpi_gpio_read_pin },
+#ifdef HAVE_GPIO_CHARDEV
+	{ "chardev", gpio_chardev_init, gpio_chardev_end, gpio_chardev_setup_pin, gpio_chardev_read_pin },
+#else
+	{ "chardev", NULL, NULL, NULL, NULL },
+#endif
+	{ "sim", gpio_sim_init, gpio_sim_end, gpio_sim_setup_pin, gpio_sim_read_pin }
+};
+struct zyncoder_gpio_backend_st *zyncoder_gpio=zyncoder_gpio_backends;
+const char *zyncoder_gpio_device=NULL;
+int zyncoder_gpio_initialized=0;
+
+int set_zyncoder_gpio_backend(enum zyncoder_gpio_backend_enum backend, const char *device) {
+	if (zyncoder_gpio_initialized) {
+		fprintf (stderr, "Zyncoder: GPIO backend must be set before initializing the library!\n");
+		return -1;
+	}
+	if (backend>ZYNCODER_GPIO_SIM || zyncoder_gpio_backends[backend].init==NULL) {
+		fprintf (stderr, "Zyncoder: GPIO backend (%d) is not available!\n", backend);
+		return -1;
+	}
+	zyncoder_gpio=zyncoder_gpio_backends+backend;
+	zyncoder_gpio_device=device;
+	return 0;
 }
 
-int zynmidi_send_program_change(uint8_t chan, uint8_t prgm) {
-	uint8_t buffer[3];
-	buffer[0] = 0xC0 + (chan & 0x0F);
-	buffer[1] = prgm;
-	buffer[2] = 0;
-	return jack_write_midi_event(buffer,3);
+int init_zyncoder_gpio() {
+	if (zyncoder_gpio_initialized) return 0;
+	memset(zyncoder_gpio_map, 0, sizeof(zyncoder_gpio_map));
+	if (zyncoder_gpio->init(zyncoder_gpio_device)) return -1;
+	zyncoder_gpio_initialized=1;
+	return 0;
 }
 
-int zynmidi_send_pitchbend_change(uint8_t chan, uint16_t pb) {
-	uint8_t buffer[3];
-	buffer[0] = 0xE0 + (chan & 0x0F);
-	buffer[1] = pb & 0x7F;
-	buffer[2] = (pb >> 7) & 0x7F;
-	return jack_write_midi_event(buffer,3);
+void end_zyncoder_gpio() {
+	if (!zyncoder_gpio_initialized) return;
+	zyncoder_gpio->end();
+	zyncoder_gpio_initialized=0;
 }
 
-int zynmidi_send_master_ccontrol_change(uint8_t ctrl, uint8_t val) {
-	if (midi_filter.master_chan>=0) {
-		return zynmidi_send_ccontrol_change(midi_filter.master_chan, ctrl, val);
+int setup_zyncoder_gpio_pin(uint8_t pin, uint8_t type, uint8_t index) {
+	if (pin>=ZYNCODER_GPIO_MAX_PINS) {
+		fprintf (stderr, "Zyncoder: GPIO pin (%d) is out of range!\n", pin);
+		return -1;
 	}
+	zyncoder_gpio_map[pin].index=index;
+	zyncoder_gpio_map[pin].type=type;
+	return zyncoder_gpio->setup_pin(pin);
 }
 
+void clear_zyncoder_gpio_pin(uint8_t pin) {
+	if (pin<ZYNCODER_GPIO_MAX_PINS) zyncoder_gpio_map[pin].type=MAP_NONE;
+}
+#endif
 
 //-----------------------------------------------------------------------------
 // GPIO Switches
 //-----------------------------------------------------------------------------
 
-#ifdef MCP23017_ENCODERS
-// Update the mcp23017 based switches from ISR routine
-void update_zynswitch(uint8_t i, uint8_t status) {
-#else
-//Update ISR switches (native GPIO)
-void update_zynswitch(uint8_t i) {
-#endif
-	if (i>=MAX_NUM_ZYNSWITCHES) return;
+//Shorter presses are spurious ticks
+#define ZYNSWITCH_DEBOUNCE_US 1000
+
+//Update switch from its pin status at tsus (us, monotonic clock)
+void update_zynswitch_state(uint8_t i, uint8_t status, unsigned long tsus) {
+	if (i>=num_zynswitches) return;
 	struct zynswitch_st *zynswitch = zynswitches + i;
 	if (zynswitch->enabled==0) return;
-
-#ifndef MCP23017_ENCODERS
-	uint8_t status=digitalRead(zynswitch->pin);
-#endif
 	if (status==zynswitch->status) return;
 	zynswitch->status=status;
 
-	struct timespec ts;
-	unsigned long int tsus;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	tsus=ts.tv_sec*1000000 + ts.tv_nsec/1000;
-
 	//printf("SWITCH ISR %d => STATUS=%d (%lu)\n",i,zynswitch->status,tsus);
 	if (zynswitch->status==1) {
 		int dtus=tsus-zynswitch->tsus;
 		//Ignore spurious ticks
-		if (dtus<1000) return;
+		if (dtus<ZYNSWITCH_DEBOUNCE_US) return;
 		//printf("Debounced Switch %d\n",i);
 		if (zynswitch->tsus>0) zynswitch->dtus=dtus;
 	} else zynswitch->tsus=tsus;
 }
 
-#ifndef MCP23017_ENCODERS
-void update_zynswitch_0() { update_zynswitch(0); }
-void update_zynswitch_1() { update_zynswitch(1); }
-void update_zynswitch_2() { update_zynswitch(2); }
-void update_zynswitch_3() { update_zynswitch(3); }
-void update_zynswitch_4() { update_zynswitch(4); }
-void update_zynswitch_5() { update_zynswitch(5); }
-void update_zynswitch_6() { update_zynswitch(6); }
-void update_zynswitch_7() { update_zynswitch(7); }
-void (*update_zynswitch_funcs[8])={
-	update_zynswitch_0,
-	update_zynswitch_1,
-	update_zynswitch_2,
-	update_zynswitch_3,
-	update_zynswitch_4,
-	update_zynswitch_5,
-	update_zynswitch_6,
-	update_zynswitch_7
-};
-#endif
+//Release of a press captured by a GPIO expander (INTCAP) before its port was read => the
+//press was latched by the chip, so it's not a spurious tick even if the release comes
+//sooner than the debounce time => counted as a minimum length press.
+void update_zynswitch_captured_state(uint8_t i, uint8_t status, unsigned long tsus) {
+	if (i>=num_zynswitches) return;
+	struct zynswitch_st *zynswitch = zynswitches + i;
+	if (status==1 && zynswitch->status==0 && zynswitch->tsus>0 && tsus-zynswitch->tsus<ZYNSWITCH_DEBOUNCE_US) {
+		tsus=zynswitch->tsus+ZYNSWITCH_DEBOUNCE_US;
+	}
+	update_zynswitch_state(i, status, tsus);
+}
 
-//Update NON-ISR switches (expanded GPIO)
-void update_expanded_zynswitches() {
-	struct timespec ts;
-	unsigned long int tsus;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	tsus=ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#ifdef MCP23017_ENCODERS
+// Update the mcp23017 based switches from ISR routine. Captured => see update_zynswitch_captured_state
+void update_zynswitch(uint8_t i, uint8_t status, unsigned long tsus, uint8_t captured) {
+	if (captured) update_zynswitch_captured_state(i, status, tsus);
+	else update_zynswitch_state(i, status, tsus);
+}
+#else
+//Update native GPIO switches => read the pin now
+void update_zynswitch(uint8_t i) {
+	if (i>=num_zynswitches || zynswitches[i].enabled==0) return;
+	update_zynswitch_state(i, zyncoder_gpio->read_pin(zynswitches[i].pin), get_zyncoder_tsus());
+}
+#endif
 
-	int i;
-	uint8_t status;
-	for (i=0;i<MAX_NUM_ZYNSWITCHES;i++) {
+#ifndef MCP23017_ENCODERS
+//Update NON-ISR switches (expanded GPIO) => MCP23008 INT line ISR or polling thread
+pthread_mutex_t expanded_zynswitches_lock=PTHREAD_MUTEX_INITIALIZER;
+
+//Update expanded switches from a MCP23008 port value read at tsus. Switch releases on
+//"captured" bits complete a press latched in INTCAP. Returns the number of changed switches.
+int update_expanded_zynswitches_port(uint8_t port, unsigned long tsus, uint8_t captured) {
+	int i, n=0;
+	uint8_t bit, status;
+	for (i=0;i<num_zynswitches;i++) {
 		struct zynswitch_st *zynswitch = zynswitches + i;
-		if (!zynswitch->enabled || zynswitch->pin<100) continue;
-		status=digitalRead(zynswitch->pin);
+		if (!zynswitch->enabled || zynswitch->pin<MCP23008_BASE_PIN) continue;
+		bit=(zynswitch->pin-MCP23008_BASE_PIN) & 0x07;
+		status=(port >> bit) & 0x01;
 		//printf("POLLING SWITCH %d (%d) => %d\n",i,zynswitch->pin,status);
 		if (status==zynswitch->status) continue;
-		zynswitch->status=status;
-		//printf("POLLING SWITCH %d => STATUS=%d (%lu)\n",i,zynswitch->status,tsus);
-		if (zynswitch->status==1) {
-			int dtus=tsus-zynswitch->tsus;
-			//Ignore spurious ticks
-			if (dtus<1000) return;
-			//printf("Debounced Switch %d\n",i);
-			if (zynswitch->tsus>0) zynswitch->dtus=dtus;
-		} else zynswitch->tsus=tsus;
+		n++;
+		if ((captured >> bit) & 0x01) update_zynswitch_captured_state(i, status, tsus);
+		else update_zynswitch_state(i, status, tsus);
+	}
+	return n;
+}
+
+//Read the MCP23008 port & update the expanded switches. Returns the number of changed switches.
+int update_expanded_zynswitches() {
+	int n;
+#ifdef HAVE_WIRINGPI_LIB
+	//Setup failed => nothing to read
+	struct wiringPiNodeStruct *node=wiringPiFindNode(MCP23008_BASE_PIN);
+	if (node==NULL) return 0;
+	pthread_mutex_lock(&expanded_zynswitches_lock);
+	//One I2C read for the whole port
+	int port=wiringPiI2CReadReg8(node->fd, MCP23x08_GPIO);
+	if (port<0) {
+		pthread_mutex_unlock(&expanded_zynswitches_lock);
+		zynlog(ZYNCODER_ERR_EXPANDER_READ, MCP23x08_GPIO);
+		return 0;
+	}
+#else
+	pthread_mutex_lock(&expanded_zynswitches_lock);
+	uint8_t port=0;
+	int i;
+	for (i=0;i<num_zynswitches;i++) {
+		struct zynswitch_st *zynswitch = zynswitches + i;
+		if (!zynswitch->enabled || zynswitch->pin<MCP23008_BASE_PIN) continue;
+		if (digitalRead(zynswitch->pin)) port |= 1 << ((zynswitch->pin-MCP23008_BASE_PIN) & 0x07);
+	}
+#endif
+	n=update_expanded_zynswitches_port(port, get_zyncoder_tsus(), 0);
+	pthread_mutex_unlock(&expanded_zynswitches_lock);
+	return n;
+}
+
+#ifdef HAVE_WIRINGPI_LIB
+//MCP23008 INT line ISR => INTCAP (port when the interrupt fired, stamped at interrupt entry)
+//is processed before the current GPIO, so short presses aren't lost. Reading INTCAP clears INT.
+void mcp23008_ISR() {
+	unsigned long tsus_int=get_zyncoder_tsus();
+	struct wiringPiNodeStruct *node=wiringPiFindNode(MCP23008_BASE_PIN);
+	if (node==NULL) return;
+	pthread_mutex_lock(&expanded_zynswitches_lock);
+	int intf=wiringPiI2CReadReg8(node->fd, MCP23x08_INTF);
+	//Sequential read => INTCAP in low byte, GPIO in high byte
+	int regs=wiringPiI2CReadReg16(node->fd, MCP23x08_INTCAP);
+	if (intf<0 || regs<0) {
+		pthread_mutex_unlock(&expanded_zynswitches_lock);
+		zynlog(ZYNCODER_ERR_EXPANDER_READ, intf<0 ? MCP23x08_INTF : MCP23x08_INTCAP);
+		return;
+	}
+	uint8_t intcap=regs & 0xFF;
+	uint8_t gpio=(regs >> 8) & 0xFF;
+	unsigned long tsus=get_zyncoder_tsus();
+	if (intf) update_expanded_zynswitches_port(intcap, tsus_int, 0);
+	update_expanded_zynswitches_port(gpio, tsus, intf ? intcap ^ gpio : 0);
+	pthread_mutex_unlock(&expanded_zynswitches_lock);
+}
+#endif
+
+int set_zynswitches_int_pin(int pin) {
+#ifdef HAVE_WIRINGPI_LIB
+	struct wiringPiNodeStruct *node=wiringPiFindNode(MCP23008_BASE_PIN);
+	if (node==NULL) {
+		fprintf (stderr, "Zyncoder: MCP23008 is not initialized!\n");
+		return -1;
+	}
+	if (pin<0) {
+		//wiringPi ISRs can't be removed => disable the MCP23008 interrupts
+		wiringPiI2CWriteReg8(node->fd, MCP23x08_GPINTEN, 0);
+		zynswitches_int_pin=-1;
+		return 0;
 	}
+	if (zynswitches_int_pin>=0 && zynswitches_int_pin!=pin) {
+		fprintf (stderr, "Zyncoder: MCP23008 INT line is already attached to pin %d!\n", zynswitches_int_pin);
+		return -1;
+	}
+	//Interrupt on change, active-high push-pull INT output, sequential reads
+	uint8_t iocon=wiringPiI2CReadReg8(node->fd, MCP23x08_IOCON);
+	iocon &= ~0x26;
+	iocon |= 0x02;
+	wiringPiI2CWriteReg8(node->fd, MCP23x08_IOCON, iocon);
+	wiringPiI2CWriteReg8(node->fd, MCP23x08_INTCON, 0);
+	wiringPiI2CWriteReg8(node->fd, MCP23x08_GPINTEN, 0xFF);
+	pinMode(pin, INPUT);
+	if (zynswitches_int_pin<0) wiringPiISR(pin, INT_EDGE_RISING, mcp23008_ISR);
+	zynswitches_int_pin=pin;
+	//Clear any pending interrupt, so the INT line is released
+	mcp23008_ISR();
+	return 0;
+#else
+	if (pin<0) return 0;
+	fprintf (stderr, "Zyncoder: MCP23008 interrupts need wiringPi!\n");
+	return -1;
+#endif
+}
+
+int get_zynswitches_int_pin() {
+	return zynswitches_int_pin;
+}
+
+void set_zynswitches_poll_rates(unsigned int fast_us, unsigned int slow_us, unsigned int hold_us, unsigned int watchdog_us) {
+	if (fast_us==0) fast_us=1;
+	if (slow_us<fast_us) slow_us=fast_us;
+	if (watchdog_us<slow_us) watchdog_us=slow_us;
+	poll_zynswitches_fast_us=fast_us;
+	poll_zynswitches_slow_us=slow_us;
+	poll_zynswitches_hold_us=hold_us;
+	poll_zynswitches_watchdog_us=watchdog_us;
 }
 
 void * poll_zynswitches(void *arg) {
+	unsigned int poll_us=poll_zynswitches_slow_us;
+	unsigned int idle_us=0;
 	while (1) {
-		update_expanded_zynswitches();
-		usleep(poll_zynswitches_us);
+#ifdef HAVE_WIRINGPI_LIB
+		//Interrupt mode => watchdog poll, in case an edge was missed & INT got stuck
+		if (zynswitches_int_pin>=0) {
+			mcp23008_ISR();
+			usleep(poll_zynswitches_watchdog_us);
+			continue;
+		}
+#endif
+		if (update_expanded_zynswitches()>0) {
+			poll_us=poll_zynswitches_fast_us;
+			idle_us=0;
+		} else if (idle_us<poll_zynswitches_hold_us) {
+			idle_us+=poll_us;
+		} else if (poll_us<poll_zynswitches_slow_us) {
+			//Back off exponentially when idle
+			poll_us*=2;
+			if (poll_us>poll_zynswitches_slow_us) poll_us=poll_zynswitches_slow_us;
+		}
+		usleep(poll_us);
 	}
 	return NULL;
 }
@@ -1000,12 +3359,13 @@ pthread_t init_poll_zynswitches() {
 		return tid;
 	}
 }
+#endif
 
 //-----------------------------------------------------------------------------
 
 struct zynswitch_st *setup_zynswitch(uint8_t i, uint8_t pin) {
-	if (i >= MAX_NUM_ZYNSWITCHES) {
-		printf("Zyncoder: Maximum number of zynswitches exceeded: %d\n", MAX_NUM_ZYNSWITCHES);
+	if (i >= num_zynswitches) {
+		printf("Zyncoder: Maximum number of zynswitches exceeded: %d\n", num_zynswitches);
 		return NULL;
 	}
 	
@@ -1017,17 +3377,18 @@ struct zynswitch_st *setup_zynswitch(uint8_t i, uint8_t pin) {
 	zynswitch->status = 0;
 
 	if (pin>0) {
-		pinMode(pin, INPUT);
-		pullUpDnControl(pin, PUD_UP);
 #ifndef MCP23017_ENCODERS
 		if (pin<MCP23008_BASE_PIN) {
-			wiringPiISR(pin,INT_EDGE_BOTH, update_zynswitch_funcs[i]);
+			setup_zyncoder_gpio_pin(pin, MAP_ZYNSWITCH, i);
 			update_zynswitch(i);
+		} else {
+			pinMode(pin, INPUT);
+			pullUpDnControl(pin, PUD_UP);
 		}
 #else
-		// this is a bit brute force, but update all the banks
-		mcp23017_bank_ISR(0);
-		mcp23017_bank_ISR(1);
+		pinMode(pin, INPUT);
+		pullUpDnControl(pin, PUD_UP);
+		update_mcp23017_dispatch();
 #endif
 	}
 
@@ -1035,7 +3396,7 @@ struct zynswitch_st *setup_zynswitch(uint8_t i, uint8_t pin) {
 }
 
 unsigned int get_zynswitch_dtus(uint8_t i) {
-	if (i >= MAX_NUM_ZYNSWITCHES) return 0;
+	if (i >= num_zynswitches) return 0;
 	unsigned int dtus=zynswitches[i].dtus;
 	zynswitches[i].dtus=0;
 	return dtus;
@@ -1049,77 +3410,127 @@ unsigned int get_zynswitch(uint8_t i) {
 // Generic Rotary Encoders
 //-----------------------------------------------------------------------------
 
+//Pull mode => encoders only flag changes and jack_process sends the latest value, once per cycle
+int zyncoders_pull_mode=0;
+_Atomic(zyncoder_mask_t) zyncoders_dirty;
+
+void set_zyncoders_pull_mode(int enabled) {
+	zyncoders_pull_mode=enabled;
+}
+
+//Stage a CC for every encoder changed since the last cycle (pull mode)
+void jack_out_zyncoders() {
+	zyncoder_mask_t dirty=atomic_exchange(&zyncoders_dirty,0);
+	int i;
+	for (i=0;dirty;i++,dirty>>=1) {
+		if (!(dirty & 0x1)) continue;
+		struct zyncoder_st *zyncoder = zyncoders + i;
+		struct zyncoder_config_st *config = zyncoders_config + i;
+		if (zyncoder->enabled==0 || config->midi_ctrl==0) continue;
+		uint8_t buffer[3];
+		buffer[0]=0xB0 + (config->midi_chan & 0x0F);
+		buffer[1]=config->midi_ctrl & 0x7F;
+		buffer[2]=zyncoder->value & 0x7F;
+		jack_out_event(0,buffer,3);
+	}
+}
+
 void send_zyncoder(uint8_t i) {
-	if (i>=MAX_NUM_ZYNCODERS) return;
+	if (i>=num_zyncoders) return;
 	struct zyncoder_st *zyncoder = zyncoders + i;
+	struct zyncoder_config_st *config = zyncoders_config + i;
 	if (zyncoder->enabled==0) return;
-	if (zyncoder->midi_ctrl>0) {
-		zynmidi_send_ccontrol_change(zyncoder->midi_chan,zyncoder->midi_ctrl,zyncoder->value);
-		//printf("SEND MIDI CHAN %d, CTRL %d = %d\n",zyncoder->midi_chan,zyncoder->midi_ctrl,zyncoder->value);
-	} else if (osc_lo_addr!=NULL && zyncoder->osc_path[0]) {
-		if (zyncoder->step >= 8) {
-			if (zyncoder->value>=64) {
-				lo_send(osc_lo_addr,zyncoder->osc_path, "T");
-				//printf("SEND OSC %s => T\n",zyncoder->osc_path);
-			} else {
-				lo_send(osc_lo_addr,zyncoder->osc_path, "F");
-				//printf("SEND OSC %s => F\n",zyncoder->osc_path);
-			}
-		} else {
-			lo_send(osc_lo_addr,zyncoder->osc_path, "i",zyncoder->value);
-			//printf("SEND OSC %s => %d\n",zyncoder->osc_path,zyncoder->value);
+	if (config->midi_ctrl>0) {
+		if (zyncoders_pull_mode) {
+			atomic_fetch_or(&zyncoders_dirty,(zyncoder_mask_t)1 << i);
+			return;
 		}
+		zynmidi_send_ccontrol_change(config->midi_chan,config->midi_ctrl,zyncoder->value);
+		//printf("SEND MIDI CHAN %d, CTRL %d = %d\n",config->midi_chan,config->midi_ctrl,zyncoder->value);
+	} else if (osc_send_running && config->osc_path[0]) {
+		queue_zyncoder_osc(i);
 	}
 }
 
-#ifdef MCP23017_ENCODERS
-void update_zyncoder(uint8_t i, uint8_t MSB, uint8_t LSB) {
-#else
-void update_zyncoder(uint8_t i) {
-#endif
-	if (i>=MAX_NUM_ZYNCODERS) return;
+//Multiplier (Q8) for an average tick interval => piecewise linear curve
+#define ZYNCODER_ACCEL_MAX_DTUS 1000000
+unsigned int get_zyncoder_accel_mult(struct zyncoder_accel_st *accel, unsigned int dtus) {
+	int j;
+	//Published by setup_zyncoder_accel after the points => read it once
+	unsigned int npoints=atomic_load_explicit(&accel->npoints,memory_order_acquire);
+	if (dtus<=accel->dtus[0]) return accel->mult_q8[0];
+	for (j=1;j<npoints;j++) {
+		if (dtus<=accel->dtus[j]) {
+			unsigned int x0=accel->dtus[j-1];
+			int y0=accel->mult_q8[j-1];
+			int y1=accel->mult_q8[j];
+			//Points being rewritten can be out of order
+			if (accel->dtus[j]<=x0) return y1;
+			return y0+(int64_t)(y1-y0)*(dtus-x0)/(accel->dtus[j]-x0);
+		}
+	}
+	return accel->mult_q8[npoints-1];
+}
+
+//Quadrature decoder => index is (last state << 2 | state). Values are the direction of the
+//transition: 0 => no change, QUADRATURE_INVALID => both pins changed.
+#define QUADRATURE_INVALID 2
+const int8_t zyncoder_quadrature_table[16]={
+	0, -1, 1, QUADRATURE_INVALID,
+	1, 0, QUADRATURE_INVALID, -1,
+	-1, QUADRATURE_INVALID, 0, 1,
+	QUADRATURE_INVALID, 1, -1, 0
+};
+
+//Update encoder from its pin states at tsus (us, monotonic clock)
+void update_zyncoder_state(uint8_t i, uint8_t MSB, uint8_t LSB, unsigned long tsus) {
+	if (i>=num_zyncoders) return;
 	struct zyncoder_st *zyncoder = zyncoders + i;
 	if (zyncoder->enabled==0) return;
 
-#ifndef MCP23017_ENCODERS
-	uint8_t MSB = digitalRead(zyncoder->pin_a);
-	uint8_t LSB = digitalRead(zyncoder->pin_b);
-#endif
 	uint8_t encoded = (MSB << 1) | LSB;
 	uint8_t sum = (zyncoder->last_encoded << 2) | encoded;
-	uint8_t up=(sum == 0b1101 || sum == 0b0100 || sum == 0b0010 || sum == 0b1011);
-	uint8_t down=0;
-	if (!up) down=(sum == 0b1110 || sum == 0b0111 || sum == 0b0001 || sum == 0b1000);
+	int8_t dir = zyncoder_quadrature_table[sum];
 #ifdef DEBUG
-	printf("zyncoder %2d - %08d\t%08d\t%d\t%d\n", i, int_to_int(encoded), int_to_int(sum), up, down);
+	printf("zyncoder %2d - %08d\t%08d\t%d\n", i, int_to_int(encoded), int_to_int(sum), dir);
 #endif
 	zyncoder->last_encoded=encoded;
+	if (dir==0) return;
+	if (dir==QUADRATURE_INVALID) {
+		zyncoder->invalid_count++;
+		zyncoder->step_acc=0;
+		return;
+	}
+	//Step modes => count transitions until a full step
+	int8_t transitions=1 << zyncoder->step_mode;
+	int8_t step_acc=zyncoder->step_acc+dir;
+	if (step_acc>-transitions && step_acc<transitions) {
+		zyncoder->step_acc=step_acc;
+		return;
+	}
+	zyncoder->step_acc=0;
+	uint8_t up=(step_acc>0);
+	uint8_t down=!up;
 
 	if (zyncoder->step==0) {
 		//Get time interval from last tick
-		struct timespec ts;
-		unsigned long int tsus;
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		tsus=ts.tv_sec*1000000 + ts.tv_nsec/1000;
 		unsigned int dtus=tsus-zyncoder->tsus;
 		//printf("ZYNCODER ISR %d => SUBVALUE=%d (%u)\n",i,zyncoder->subvalue,dtus);
 		//Ignore spurious ticks
-		if (dtus<1000) return;
+		struct zyncoder_accel_st *accel = &zyncoders_config[i].accel;
+		if (dtus<accel->debounce_us) return;
 		//printf("ZYNCODER DEBOUNCED ISR %d => SUBVALUE=%d (%u)\n",i,zyncoder->subvalue,dtus);
-		//Calculate average dtus for the last ZYNCODER_TICKS_PER_RETENT ticks
-		int j;
-		unsigned int dtus_avg=dtus;
-		for (j=0;j<ZYNCODER_TICKS_PER_RETENT;j++) dtus_avg+=zyncoder->dtus[j];
-		dtus_avg/=(ZYNCODER_TICKS_PER_RETENT+1);
-		//Add last dtus to fifo array
-		zyncoder->dtus[0]=zyncoder->dtus[1];
-		zyncoder->dtus[1]=zyncoder->dtus[2];
-		zyncoder->dtus[2]=zyncoder->dtus[3];
-		zyncoder->dtus[3]=dtus;
-		//Calculate step value
-		unsigned int dsval=1;
-		if (dtus_avg < 10000) dsval=ZYNCODER_TICKS_PER_RETENT;
-		else if (dtus_avg < 30000) dsval=ZYNCODER_TICKS_PER_RETENT/2;
+		//Average dtus for this tick & the last ZYNCODER_TICKS_PER_RETENT ones => ring history with
+		//running sum. Intervals are clamped so the sum can't overflow.
+		if (dtus>ZYNCODER_ACCEL_MAX_DTUS) dtus=ZYNCODER_ACCEL_MAX_DTUS;
+		unsigned int dtus_avg=(dtus+zyncoder->dtus_sum)/(ZYNCODER_TICKS_PER_RETENT+1);
+		zyncoder->dtus_sum+=dtus-zyncoder->dtus[zyncoder->dtus_index];
+		zyncoder->dtus[zyncoder->dtus_index]=dtus;
+		zyncoder->dtus_index=(zyncoder->dtus_index+1) % ZYNCODER_TICKS_PER_RETENT;
+		//Calculate step value => scaled by the transitions per step. Fraction is kept for next tick.
+		unsigned int dsval=get_zyncoder_accel_mult(accel,dtus_avg/transitions)*transitions+zyncoder->accel_frac;
+		zyncoder->accel_frac=dsval & 0xFF;
+		dsval>>=8;
 
 		int value=-1;
 		if (up) {
@@ -1150,44 +3561,56 @@ void update_zyncoder(uint8_t i) {
 
 }
 
-#ifndef MCP23017_ENCODERS
-void update_zyncoder_0() { update_zyncoder(0); }
-void update_zyncoder_1() { update_zyncoder(1); }
-void update_zyncoder_2() { update_zyncoder(2); }
-void update_zyncoder_3() { update_zyncoder(3); }
-void update_zyncoder_4() { update_zyncoder(4); }
-void update_zyncoder_5() { update_zyncoder(5); }
-void update_zyncoder_6() { update_zyncoder(6); }
-void update_zyncoder_7() { update_zyncoder(7); }
-void (*update_zyncoder_funcs[8])={
-	update_zyncoder_0,
-	update_zyncoder_1,
-	update_zyncoder_2,
-	update_zyncoder_3,
-	update_zyncoder_4,
-	update_zyncoder_5,
-	update_zyncoder_6,
-	update_zyncoder_7
-};
+#ifdef MCP23017_ENCODERS
+void update_zyncoder(uint8_t i, uint8_t MSB, uint8_t LSB, unsigned long tsus) {
+	update_zyncoder_state(i, MSB, LSB, tsus);
+}
+#else
+//Update native GPIO encoders => read both pins now
+void update_zyncoder(uint8_t i) {
+	if (i>=num_zyncoders) return;
+	struct zyncoder_st *zyncoder = zyncoders + i;
+	if (zyncoder->enabled==0) return;
+	zyncoder->pin_a_last_state = zyncoder_gpio->read_pin(zyncoder->pin_a);
+	zyncoder->pin_b_last_state = zyncoder_gpio->read_pin(zyncoder->pin_b);
+	update_zyncoder_state(i, zyncoder->pin_a_last_state, zyncoder->pin_b_last_state, get_zyncoder_tsus());
+}
 #endif
 
 //-----------------------------------------------------------------------------
 
+//Bind/unbind zyncoder to its MIDI controller in the reverse index used by jack_process
+void bind_zyncoder_midi_ctrl(uint8_t i) {
+	struct zyncoder_config_st *config = zyncoders_config + i;
+	zyncoder_midi_ctrl_map[config->midi_chan][config->midi_ctrl] |= (zyncoder_mask_t)1 << i;
+}
+
+void unbind_zyncoder_midi_ctrl(uint8_t i) {
+	struct zyncoder_config_st *config = zyncoders_config + i;
+	zyncoder_midi_ctrl_map[config->midi_chan][config->midi_ctrl] &= ~((zyncoder_mask_t)1 << i);
+}
+
 struct zyncoder_st *setup_zyncoder(uint8_t i, uint8_t pin_a, uint8_t pin_b, uint8_t midi_chan, uint8_t midi_ctrl, char *osc_path, unsigned int value, unsigned int max_value, unsigned int step) {
-	if (i > MAX_NUM_ZYNCODERS) {
-		printf("Zyncoder: Maximum number of zyncoders exceded: %d\n", MAX_NUM_ZYNCODERS);
+	if (i >= num_zyncoders) {
+		printf("Zyncoder: Maximum number of zyncoders exceded: %d\n", num_zyncoders);
 		return NULL;
 	}
 
 	struct zyncoder_st *zyncoder = zyncoders + i;
+	struct zyncoder_config_st *config = zyncoders_config + i;
 	if (midi_chan>15) midi_chan=0;
 	if (midi_ctrl>127) midi_ctrl=1;
 	if (value>max_value) value=max_value;
-	zyncoder->midi_chan = midi_chan;
-	zyncoder->midi_ctrl = midi_ctrl;
+	if (zyncoder->enabled) unbind_zyncoder_midi_ctrl(i);
+	config->midi_chan = midi_chan;
+	config->midi_ctrl = midi_ctrl;
 	//printf("OSC PATH: %s\n",osc_path);
-	if (osc_path) strcpy(zyncoder->osc_path,osc_path);
-	else zyncoder->osc_path[0]=0;
+	if (osc_path) {
+		strncpy(config->osc_path,osc_path,sizeof(config->osc_path)-1);
+		config->osc_path[sizeof(config->osc_path)-1]=0;
+	}
+	else config->osc_path[0]=0;
+	update_zyncoder_osc_msg(i);
 	zyncoder->step = step;
 	if (step>0) {
 		zyncoder->value = value;
@@ -1204,34 +3627,109 @@ struct zyncoder_st *setup_zyncoder(uint8_t i, uint8_t pin_a, uint8_t pin_b, uint
 		zyncoder->pin_a = pin_a;
 		zyncoder->pin_b = pin_b;
 		zyncoder->last_encoded = 0;
+		zyncoder->step_acc = 0;
+		zyncoder->invalid_count = 0;
 		zyncoder->tsus = 0;
 
 		if (zyncoder->pin_a!=zyncoder->pin_b) {
+#ifndef MCP23017_ENCODERS
+			setup_zyncoder_gpio_pin(pin_a, MAP_ZYNCODER, i);
+			setup_zyncoder_gpio_pin(pin_b, MAP_ZYNCODER, i);
+			//Start decoding from the current pin states
+			zyncoder->pin_a_last_state = zyncoder_gpio->read_pin(pin_a);
+			zyncoder->pin_b_last_state = zyncoder_gpio->read_pin(pin_b);
+			zyncoder->last_encoded = (zyncoder->pin_a_last_state << 1) | zyncoder->pin_b_last_state;
+#else
 			pinMode(pin_a, INPUT);
 			pinMode(pin_b, INPUT);
 			pullUpDnControl(pin_a, PUD_UP);
 			pullUpDnControl(pin_b, PUD_UP);
-#ifndef MCP23017_ENCODERS
-			wiringPiISR(pin_a,INT_EDGE_BOTH, update_zyncoder_funcs[i]);
-			wiringPiISR(pin_b,INT_EDGE_BOTH, update_zyncoder_funcs[i]);
-#else
-			// this is a bit brute force, but update all the banks
-			mcp23017_bank_ISR(0);
-			mcp23017_bank_ISR(1);
+			update_mcp23017_dispatch();
 #endif
 		}
 	}
+	bind_zyncoder_midi_ctrl(i);
+	if (osc_server!=NULL) update_osc_path_hash();
 
 	return zyncoder;
 }
 
+void disable_zyncoder(uint8_t i) {
+	if (i >= num_zyncoders) return;
+	struct zyncoder_st *zyncoder = zyncoders + i;
+	if (zyncoder->enabled==0) return;
+	unbind_zyncoder_midi_ctrl(i);
+	atomic_fetch_and(&zyncoders_dirty,~((zyncoder_mask_t)1 << i));
+	atomic_fetch_and(&zyncoders_osc_dirty,~((zyncoder_mask_t)1 << i));
+	zyncoder->enabled = 0;
+#ifdef MCP23017_ENCODERS
+	update_mcp23017_dispatch();
+#else
+	clear_zyncoder_gpio_pin(zyncoder->pin_a);
+	clear_zyncoder_gpio_pin(zyncoder->pin_b);
+#endif
+	if (osc_server!=NULL) update_osc_path_hash();
+}
+
+void set_zyncoder_step_mode(uint8_t i, enum zyncoder_step_mode_enum mode) {
+	if (i >= num_zyncoders) return;
+	if (mode>ZYNCODER_FULL_STEP) {
+		fprintf (stderr, "Zyncoder: Bad step mode (%d) for zyncoder %d!\n", mode, i);
+		return;
+	}
+	zyncoders[i].step_mode = mode;
+	zyncoders[i].step_acc = 0;
+}
+
+//Default profile => x4 under 10ms, x2 under 30ms
+unsigned int zyncoder_accel_default_dtus[4]={ 9999, 10000, 29999, 30000 };
+unsigned int zyncoder_accel_default_mult[4]={ ZYNCODER_TICKS_PER_RETENT << 8, (ZYNCODER_TICKS_PER_RETENT/2) << 8, (ZYNCODER_TICKS_PER_RETENT/2) << 8, 1 << 8 };
+
+int setup_zyncoder_accel(uint8_t i, unsigned int debounce_us, unsigned int npoints, unsigned int *dtus, unsigned int *mult_q8) {
+	int j;
+	if (i >= num_zyncoders) return 0;
+	if (npoints==0) {
+		debounce_us=1000;
+		npoints=4;
+		dtus=zyncoder_accel_default_dtus;
+		mult_q8=zyncoder_accel_default_mult;
+	}
+	if (npoints>ZYNCODER_ACCEL_MAX_POINTS) {
+		fprintf (stderr, "Zyncoder: Too many acceleration points (%d) for zyncoder %d!\n", npoints, i);
+		return 0;
+	}
+	for (j=0;j<npoints;j++) {
+		if ((j>0 && dtus[j]<=dtus[j-1]) || mult_q8[j]==0) {
+			fprintf (stderr, "Zyncoder: Bad acceleration point %d for zyncoder %d!\n", j, i);
+			return 0;
+		}
+	}
+	struct zyncoder_accel_st *accel = &zyncoders_config[i].accel;
+	//Points count is published last, with release order => the ISR never reads unset points
+	atomic_store_explicit(&accel->npoints,1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	accel->debounce_us = debounce_us;
+	for (j=0;j<npoints;j++) {
+		accel->dtus[j] = dtus[j];
+		accel->mult_q8[j] = mult_q8[j];
+	}
+	atomic_store_explicit(&accel->npoints,npoints,memory_order_release);
+	zyncoders[i].accel_frac = 0;
+	return 1;
+}
+
+unsigned int get_zyncoder_invalid_count(uint8_t i) {
+	if (i >= num_zyncoders) return 0;
+	return zyncoders[i].invalid_count;
+}
+
 unsigned int get_value_zyncoder(uint8_t i) {
-	if (i >= MAX_NUM_ZYNCODERS) return 0;
+	if (i >= num_zyncoders) return 0;
 	return zyncoders[i].value;
 }
 
 void set_value_zyncoder(uint8_t i, unsigned int v, int send) {
-	if (i >= MAX_NUM_ZYNCODERS) return;
+	if (i >= num_zyncoders) return;
 	struct zyncoder_st *zyncoder = zyncoders + i;
 	if (zyncoder->enabled==0) return;
 
@@ -1253,63 +3751,167 @@ void set_value_zyncoder(uint8_t i, unsigned int v, int send) {
 // MCP23017 based encoders & switches
 //-----------------------------------------------------------------------------
 
-// ISR for handling the mcp23017 interrupts
-void mcp23017_bank_ISR(uint8_t bank) {
-	// the interrupt has gone off for a pin change on the mcp23017
-	// read the appropriate bank and compare pin states to last
-	// on a change, call the update function as appropriate
-	int i;
-	uint8_t reg;
-	uint8_t pin_min, pin_max;
+//Per-bank dispatch table => zyncoder/zynswitch attached to each bit, built at setup
+#define MCP23017_NO_HANDLER 0xFF
+struct mcp23017_bank_st {
+	uint8_t reg;			// last value read from GPIO register
+	volatile uint8_t resync;	// dispatch all bits on next read
+	uint8_t zyncoder[8];
+	uint8_t zynswitch[8];
+};
+struct mcp23017_bank_st mcp23017_banks[2];
+// serializes the two bank ISR threads & dispatch table updates
+pthread_mutex_t mcp23017_lock=PTHREAD_MUTEX_INITIALIZER;
+struct mcp23017_isr_stats_st mcp23017_isr_stats;
+
+//Rebuild the bank dispatch tables from the enabled zyncoders & zynswitches
+void update_mcp23017_dispatch() {
+	int i,bank,bit;
+	struct mcp23017_bank_st banks[2];
+	memset(banks,MCP23017_NO_HANDLER,sizeof(banks));
+	for (i=0; i<num_zyncoders; i++) {
+		struct zyncoder_st *zyncoder = zyncoders + i;
+		if (zyncoder->enabled==0 || zyncoder->pin_a==zyncoder->pin_b) continue;
+		if (zyncoder->pin_a>=MCP23017_BASE_PIN && zyncoder->pin_a<MCP23017_BASE_PIN+16) {
+			bit = zyncoder->pin_a - MCP23017_BASE_PIN;
+			banks[bit>>3].zyncoder[bit&7] = i;
+		}
+		if (zyncoder->pin_b>=MCP23017_BASE_PIN && zyncoder->pin_b<MCP23017_BASE_PIN+16) {
+			bit = zyncoder->pin_b - MCP23017_BASE_PIN;
+			banks[bit>>3].zyncoder[bit&7] = i;
+		}
+	}
+	for (i=0; i<num_zynswitches; i++) {
+		struct zynswitch_st *zynswitch = zynswitches + i;
+		if (zynswitch->enabled==0) continue;
+		if (zynswitch->pin>=MCP23017_BASE_PIN && zynswitch->pin<MCP23017_BASE_PIN+16) {
+			bit = zynswitch->pin - MCP23017_BASE_PIN;
+			banks[bit>>3].zynswitch[bit&7] = i;
+		}
+	}
+	pthread_mutex_lock(&mcp23017_lock);
+	for (bank=0; bank<2; bank++) {
+		memcpy(mcp23017_banks[bank].zyncoder, banks[bank].zyncoder, 8);
+		memcpy(mcp23017_banks[bank].zynswitch, banks[bank].zynswitch, 8);
+		// newly attached controls must catch up with the current pin state
+		mcp23017_banks[bank].resync = 1;
+	}
+	pthread_mutex_unlock(&mcp23017_lock);
+	mcp23017_ISR();
+}
 
-	if (bank == 0) {
-		reg = wiringPiI2CReadReg8(mcp23017_node->fd, MCP23x17_GPIOA);
-		pin_min = MCP23017_BASE_PIN;
-	} else {
-		reg = wiringPiI2CReadReg8(mcp23017_node->fd, MCP23x17_GPIOB);
-		pin_min = MCP23017_BASE_PIN + 8;
+//Read n consecutive registers in a single I2C transfer => register address write and data
+//read are joined by a repeated start, so the interrupt state can't change in between.
+int mcp23017_read_regs(uint8_t reg, uint8_t *data, uint8_t n) {
+#ifdef HAVE_WIRINGPI_LIB
+	struct i2c_msg msgs[2]={
+		{ .addr=MCP23017_I2C_ADDR, .flags=0, .len=1, .buf=&reg },
+		{ .addr=MCP23017_I2C_ADDR, .flags=I2C_M_RD, .len=n, .buf=data }
+	};
+	struct i2c_rdwr_ioctl_data rdwr={ .msgs=msgs, .nmsgs=2 };
+	int res=ioctl(mcp23017_node->fd, I2C_RDWR, &rdwr);
+#else
+	int res=wiringPiI2CReadBlock(mcp23017_node->fd, reg, data, n);
+#endif
+	//Bus time => address+register, address+data bytes (9 clocks each) plus start, repeated start & stop
+	unsigned int nbytes=n+3;
+	mcp23017_isr_stats.transfers++;
+	mcp23017_isr_stats.bytes+=nbytes;
+	mcp23017_isr_stats.bus_us+=((nbytes*9+3)*1000000ULL)/MCP23017_I2C_CLOCK_HZ;
+	if (res<0) {
+		mcp23017_isr_stats.errors++;
+		return -1;
 	}
-	pin_max = pin_min + 7;
+	return 0;
+}
 
-	// search all encoders and switches for a pin in the bank's range
-	// if the last state != current state then this pin has changed
-	// call the update function
-	for (i=0; i<MAX_NUM_ZYNCODERS; i++) {
-		struct zyncoder_st *zyncoder = zyncoders + i;
-		if (zyncoder->enabled==0) continue;
-
-		// if either pin is in the range
-		if ((zyncoder->pin_a >= pin_min && zyncoder->pin_a <= pin_max) ||
-		    (zyncoder->pin_b >= pin_min && zyncoder->pin_b <= pin_max)) {
-			uint8_t bit_a = zyncoder->pin_a - pin_min;
-			uint8_t bit_b = zyncoder->pin_b - pin_min;
-			uint8_t state_a = bitRead(reg, bit_a);
-			uint8_t state_b = bitRead(reg, bit_b);
-			// if either bit is different
+//Dispatch the bits changed since the last value seen in the bank, read at tsus. Switch
+//releases on "captured" bits complete a press latched in INTCAP.
+void mcp23017_bank_dispatch(uint8_t bank, uint8_t reg, unsigned long tsus, uint8_t captured) {
+	struct mcp23017_bank_st *mcp_bank = mcp23017_banks + bank;
+	uint8_t pin_min = MCP23017_BASE_PIN + 8*bank;
+	uint8_t changed = reg ^ mcp_bank->reg;
+	mcp_bank->reg = reg;
+	if (mcp_bank->resync) {
+		mcp_bank->resync = 0;
+		changed = 0xFF;
+	}
+
+	while (changed) {
+		int bit = __builtin_ctz(changed);
+		changed &= changed - 1;
+
+		uint8_t i = mcp_bank->zyncoder[bit];
+		if (i != MCP23017_NO_HANDLER) {
+			struct zyncoder_st *zyncoder = zyncoders + i;
+			// the other pin may be on the other bank => read its last state
+			uint8_t state_a, state_b;
+			if (zyncoder->pin_a >= pin_min && zyncoder->pin_a < pin_min + 8)
+				state_a = bitRead(reg, zyncoder->pin_a - pin_min);
+			else state_a = zyncoder->pin_a_last_state;
+			if (zyncoder->pin_b >= pin_min && zyncoder->pin_b < pin_min + 8)
+				state_b = bitRead(reg, zyncoder->pin_b - pin_min);
+			else state_b = zyncoder->pin_b_last_state;
+			// both pins changing on the same read must dispatch only once
 			if ((state_a != zyncoder->pin_a_last_state) ||
 			    (state_b != zyncoder->pin_b_last_state)) {
-				// call the update function
-				update_zyncoder(i, state_a, state_b);
-				// update the last state
+				update_zyncoder(i, state_a, state_b, tsus);
 				zyncoder->pin_a_last_state = state_a;
 				zyncoder->pin_b_last_state = state_b;
 			}
 		}
-	}
-	for (i = 0; i < MAX_NUM_ZYNSWITCHES; ++i) {
-		struct zynswitch_st *zynswitch = zynswitches + i;
-		if (zynswitch->enabled == 0) continue;
 
-		// check the pin range
-		if (zynswitch->pin >= pin_min && zynswitch->pin <= pin_max) {
-			uint8_t bit = zynswitch->pin - pin_min;
+		i = mcp_bank->zynswitch[bit];
+		if (i != MCP23017_NO_HANDLER) {
 			uint8_t state = bitRead(reg, bit);
-			if (state != zynswitch->status) {
-				update_zynswitch(i, state);
-				// note that the update function updates status with state
+			// note that the update function updates status with state
+			if (state != zynswitches[i].status) update_zynswitch(i, state, tsus, bitRead(captured, bit));
+		}
+	}
+}
+
+// ISR for handling the mcp23017 interrupts
+void mcp23017_ISR() {
+	// the interrupt has gone off for a pin change on the mcp23017.
+	// INTF, INTCAP & GPIO of both banks are read in one sequential transfer
+	// (IOCON.BANK=0 => A/B registers are interleaved). INTCAP holds the port
+	// as it was when the interrupt fired, so it's dispatched before the
+	// current GPIO value => an edge reverted before the read is not lost.
+	// INTCAP is stamped at interrupt entry, GPIO after the transfer.
+	uint8_t regs[6];
+	int bank;
+	unsigned long tsus_int = get_zyncoder_tsus();
+
+	pthread_mutex_lock(&mcp23017_lock);
+	mcp23017_isr_stats.interrupts++;
+	if (mcp23017_read_regs(MCP23x17_INTFA, regs, 6)==0) {
+		unsigned long tsus = get_zyncoder_tsus();
+		for (bank=0; bank<2; bank++) {
+			uint8_t intf = regs[bank];
+			uint8_t intcap = regs[2+bank];
+			uint8_t gpio = regs[4+bank];
+			uint8_t captured = 0;
+			if (intf) {
+				captured = intcap ^ gpio;
+				if (captured & intf) mcp23017_isr_stats.captured_edges++;
+				mcp23017_bank_dispatch(bank, intcap, tsus_int, 0);
 			}
+			mcp23017_bank_dispatch(bank, gpio, tsus, captured);
 		}
 	}
+	pthread_mutex_unlock(&mcp23017_lock);
+}
+
+void get_mcp23017_isr_stats(struct mcp23017_isr_stats_st *stats) {
+	pthread_mutex_lock(&mcp23017_lock);
+	*stats=mcp23017_isr_stats;
+	pthread_mutex_unlock(&mcp23017_lock);
+}
+
+void reset_mcp23017_isr_stats() {
+	pthread_mutex_lock(&mcp23017_lock);
+	memset(&mcp23017_isr_stats,0,sizeof(mcp23017_isr_stats));
+	pthread_mutex_unlock(&mcp23017_lock);
 }
 
 #endif
@@ -35,6 +35,30 @@
 int init_zyncoder(int osc_port);
 int end_zyncoder();
 
+//Number of zyncoders & zynswitches, up to MAX_NUM_ZYNCODERS & MAX_NUM_ZYNSWITCHES.
+//Must be called before init_zyncoder. Default is 8 & 8.
+int set_zyncoder_registry_size(int ncoders, int nswitches);
+
+//-----------------------------------------------------------------------------
+// Error counters
+//-----------------------------------------------------------------------------
+
+enum zyncoder_error_enum {
+	ZYNCODER_ERR_OUTPUT_QUEUE_FULL=0,
+	ZYNCODER_ERR_OUTPUT_EVENT_SIZE,
+	ZYNCODER_ERR_OUTPUT_TOO_MANY_EVENTS,
+	ZYNCODER_ERR_OUTPUT_BUFFER_FULL,
+	ZYNCODER_ERR_INPUT_TOO_MANY_EVENTS,
+	ZYNCODER_ERR_PORT_BUFFER,
+	ZYNCODER_ERR_GPIO_EVENTS_LOST,
+	ZYNCODER_ERR_OSC_CHANGES_FULL,
+	ZYNCODER_ERR_EXPANDER_READ,
+	NUM_ZYNCODER_ERRORS
+};
+
+unsigned int get_zyncoder_error_count(int error);
+void reset_zyncoder_error_counts();
+
 //-----------------------------------------------------------------------------
 // MIDI filter
 //-----------------------------------------------------------------------------
@@ -76,21 +100,53 @@ struct mf_arrow_st {
 	enum midi_event_type_enum type;
 };
 
+#define MF_NO_PRED 0xFFFF
+
 struct midi_filter_st {
 	int tuning_pitchbend;
 	int transpose[16];
 	struct midi_event_st event_map[8][16][128];
+	//Packed copy of event_map, used by jack_process => 2 bytes per entry
+	uint16_t event_map_packed[8][16][128];
+	//Pristine state => non-THRU entries in event_map for every [type][chan], bitmask of
+	//untouched channels for every type, and whole filter flag
+	uint8_t event_map_count[8][16];
+	uint16_t pristine_chans[8];
+	int pristine;
+	//Inverse of the CC event map => arrows received by every node (in-degree) and the
+	//node sending the last one (chan<<7 | num), or MF_NO_PRED when it's unknown
+	uint16_t cc_pred[16][128];
+	uint16_t cc_pred_count[16][128];
 
 	int master_chan;
+};
+//Packed event map entries => type+3 (5 bits) | chan (4 bits) | num (7 bits)
+#define MF_PACK_EVENT(type,chan,num) ((uint16_t)((((type)+3) << 11) | (((chan) & 0xF) << 7) | ((num) & 0x7F)))
+#define MF_PACKED_TYPE(pev) ((int)((pev) >> 11)-3)
+#define MF_PACKED_CHAN(pev) (((pev) >> 7) & 0xF)
+#define MF_PACKED_NUM(pev) ((pev) & 0x7F)
+
+//Filter copy being edited: the active one, or the shadow copy inside a transaction
+struct midi_filter_st *midi_filter;
+//Filter copy for reading from the UI side => read-only
+struct midi_filter_st *view_midi_filter();
+
+//Runtime state, updated by the MIDI filter from incoming events
+struct midi_filter_state_st {
 	uint8_t last_ctrl_val[16][128];
 	uint16_t last_pb_val[16];
 };
-struct midi_filter_st midi_filter;
+struct midi_filter_state_st midi_filter_state;
 
 //MIDI filter initialization
 void init_midi_filter();
 void set_midi_master_chan(int chan);
 
+//MIDI filter transactions => changes are built on a shadow copy and published atomically
+int begin_midi_filter_transaction();
+int commit_midi_filter_transaction();
+void abort_midi_filter_transaction();
+
 //MIDI filter fine tuning => Pitch-Bending based
 void set_midi_filter_tuning_freq(int freq);
 int get_midi_filter_tuning_pitchbend();
@@ -105,8 +161,12 @@ void set_midi_filter_event_map(enum midi_event_type_enum type_from, uint8_t chan
 															 enum midi_event_type_enum type_to, uint8_t chan_to, uint8_t num_to);
 void set_midi_filter_event_ignore_st(struct midi_event_st *ev_from);
 void set_midi_filter_event_ignore(enum midi_event_type_enum type_from, uint8_t chan_from, uint8_t num_from);
+//Returned events are per-thread copies, valid until the next call from the same thread => use
+//the set/del functions for changing the map. NULL if ev_from is out of range.
 struct midi_event_st *get_midi_filter_event_map_st(struct midi_event_st *ev_from);
 struct midi_event_st *get_midi_filter_event_map(enum midi_event_type_enum type_from, uint8_t chan_from, uint8_t num_from);
+//Copies the event mapped to ev_from into ev_to. Returns 0 if ev_from is out of range.
+int get_midi_filter_event_map_into(struct midi_event_st *ev_from, struct midi_event_st *ev_to);
 void del_midi_filter_event_map_st(struct midi_event_st *ev_filter);
 void del_midi_filter_event_map(enum midi_event_type_enum type_from, uint8_t chan_from, uint8_t num_from);
 void reset_midi_filter_event_map();
@@ -124,18 +184,33 @@ int get_mf_arrow_to(enum midi_event_type_enum type, uint8_t chan, uint8_t num, s
 int set_midi_filter_cc_swap(uint8_t chan_from, uint8_t num_from, uint8_t chan_to, uint8_t num_to);
 int del_midi_filter_cc_swap(uint8_t chan, uint8_t num);
 uint8_t get_midi_filter_cc_swap(uint8_t chan, uint8_t num);
+//Verify the swap graph (Rules A & B) and the predecessor table. Returns the number of errors found.
+int check_midi_filter_cc_swap();
+
+//MIDI Filter Presets => binary files with the whole filter state (maps, swaps, transpose,
+//tuning). Presets can be preloaded and switched atomically, even by Program Change messages
+//on the presets channel, handled by jack thread.
+#define MIDI_FILTER_PRESETS_MAX 128
+int save_midi_filter(const char *fpath);
+int load_midi_filter(const char *fpath);
+int load_midi_filter_preset(uint8_t i, const char *fpath);
+int unload_midi_filter_preset(uint8_t i);
+int select_midi_filter_preset(uint8_t i);
+void set_midi_filter_preset_chan(int chan);
 
 //-----------------------------------------------------------------------------
 // MIDI Input Events Buffer Management
 //-----------------------------------------------------------------------------
 
-#define ZYNMIDI_BUFFER_SIZE 32
-uint32_t zynmidi_buffer[ZYNMIDI_BUFFER_SIZE];
-int zynmidi_buffer_read;
-int zynmidi_buffer_write;
+// Capacity of the GUI capture queue (events). Must be a power of two.
+#ifndef ZYNMIDI_BUFFER_SIZE
+#define ZYNMIDI_BUFFER_SIZE 4096
+#endif
 
 int write_zynmidi(uint32_t ev);
 uint32_t read_zynmidi();
+int read_zynmidi_batch(uint32_t *out, int max);
+unsigned int get_zynmidi_overflow_count();
 
 //-----------------------------------------------------------------------------
 // MIDI Send Functions
@@ -149,12 +224,89 @@ int zynmidi_send_pitchbend_change(uint8_t chan, uint16_t pb);
 
 int zynmidi_send_master_ccontrol_change(uint8_t ctrl, uint8_t val);
 
+//Scheduled events => sent by jack thread at the exact frame (jack frame time). Events in the
+//past are sent at the start of the next cycle. Handles are 0 on error.
+#ifndef ZYNMIDI_SCHEDULE_SIZE
+#define ZYNMIDI_SCHEDULE_SIZE 1024
+#endif
+typedef uint32_t zynmidi_handle_t;
+//Current frame time + delay (microseconds)
+uint32_t zynmidi_get_frame_time(unsigned int delay_us);
+zynmidi_handle_t zynmidi_schedule_event(uint32_t time, uint8_t *data, int size);
+zynmidi_handle_t zynmidi_schedule_note_off(uint32_t time, uint8_t chan, uint8_t note, uint8_t vel);
+zynmidi_handle_t zynmidi_schedule_note_on(uint32_t time, uint8_t chan, uint8_t note, uint8_t vel);
+zynmidi_handle_t zynmidi_schedule_ccontrol_change(uint32_t time, uint8_t chan, uint8_t ctrl, uint8_t val);
+zynmidi_handle_t zynmidi_schedule_program_change(uint32_t time, uint8_t chan, uint8_t prgm);
+zynmidi_handle_t zynmidi_schedule_pitchbend_change(uint32_t time, uint8_t chan, uint16_t pb);
+//Returns 0 when the cancel request is queued, 1 when the event has already been sent (or
+//canceled), -1 on error. Events due in the cycle running while canceling could still be sent.
+int zynmidi_cancel_event(zynmidi_handle_t handle);
+
+//SysEx messages (F0 ... F7) are queued and sent as output space allows. Returns -1 when
+//the queue is full => retry later, or when the message is longer than the output port's
+//max event size. Rate (bytes/second) can be limited for slow MIDI links.
+int zynmidi_send_sysex(uint8_t *data, int size);
+void set_zynmidi_sysex_rate(unsigned int bytes_per_second);
+
+//Output coalescing => per cycle, only the latest message for every (type, chan, num) is sent.
+//Supported types: KEY_PRESS, CTRL_CHANGE, CHAN_PRESS, PITCH_BENDING. Note & program change
+//messages on the same channel are never crossed. Bank select (0/32), data entry (6/38) and
+//RPN/NRPN (96-101) CCs are never coalesced nor crossed. Counters return the number of messages dropped.
+void set_zynmidi_coalesce(enum midi_event_type_enum type, int enabled);
+unsigned int get_zynmidi_coalesce_count(enum midi_event_type_enum type);
+void reset_zynmidi_coalesce_counts();
+
+//-----------------------------------------------------------------------------
+// MIDI clock statistics
+//-----------------------------------------------------------------------------
+
+//Intervals between output clock ticks (0xF8), in frames. Mean & jitter (mean deviation)
+//are exponential moving averages, in fixed point Q8 => divide by 256. A gap longer than
+//2 seconds is taken as a clock stop/start => the stats restart at the first tick after it.
+struct zynmidi_clock_stats_st {
+	unsigned int ticks;
+	unsigned int last_interval;
+	unsigned int min_interval;
+	unsigned int max_interval;
+	unsigned int mean_interval_q8;
+	unsigned int jitter_q8;
+	unsigned int sample_rate;
+};
+
+void get_midi_clock_stats(struct zynmidi_clock_stats_st *stats);
+//Stats are cleared by jack thread on its next cycle
+void reset_midi_clock_stats();
+
+#ifndef MCP23017_ENCODERS
+//-----------------------------------------------------------------------------
+// GPIO backends
+//-----------------------------------------------------------------------------
+
+// Native GPIO pins (< 100) are read through a backend:
+//	+ wiringPi => one ISR thread per pin, reading the pins & time after waking up
+//	+ chardev => Linux GPIO character device (pins are the chip line offsets). A thread
+//	  reads the edge events in batches, with their kernel timestamps
+//	+ sim => simulated pins for testing, edges are injected with set_zyncoder_gpio_sim_pin
+#define ZYNCODER_GPIO_MAX_PINS 64
+
+enum zyncoder_gpio_backend_enum {
+	ZYNCODER_GPIO_WIRINGPI=0,
+	ZYNCODER_GPIO_CHARDEV=1,
+	ZYNCODER_GPIO_SIM=2
+};
+
+// must be called before init_zyncoder. device => chardev path, NULL for /dev/gpiochip0
+int set_zyncoder_gpio_backend(enum zyncoder_gpio_backend_enum backend, const char *device);
+// tsus => edge time (us, monotonic clock), 0 for now
+void set_zyncoder_gpio_sim_pin(uint8_t pin, uint8_t value, unsigned long tsus);
+#endif
+
 //-----------------------------------------------------------------------------
 // GPIO Switches
 //-----------------------------------------------------------------------------
 
-// The real limit in RPi2 is 17
-#define MAX_NUM_ZYNSWITCHES 8
+// The real limit in RPi2 is 17 => more with GPIO expanders
+#define MAX_NUM_ZYNSWITCHES 64
 
 struct zynswitch_st {
 	uint8_t enabled;
@@ -165,12 +317,22 @@ struct zynswitch_st {
 	// zyncoders
 	volatile uint8_t status;
 };
-struct zynswitch_st zynswitches[MAX_NUM_ZYNSWITCHES];
+int num_zynswitches;
+struct zynswitch_st *zynswitches;
 
 struct zynswitch_st *setup_zynswitch(uint8_t i, uint8_t pin); 
 unsigned int get_zynswitch(uint8_t i);
 unsigned int get_zynswitch_dtus(uint8_t i);
 
+#ifndef MCP23017_ENCODERS
+//MCP23008 expanded switches (pin>=100) => interrupt driven if its INT line is wired to a GPIO
+//(pin=-1 => polling). The poll thread runs at fast_us after activity, backing off to slow_us
+//when idle for hold_us. In interrupt mode it only polls every watchdog_us (1s by default).
+int set_zynswitches_int_pin(int pin);
+int get_zynswitches_int_pin();
+void set_zynswitches_poll_rates(unsigned int fast_us, unsigned int slow_us, unsigned int hold_us, unsigned int watchdog_us);
+#endif
+
 //-----------------------------------------------------------------------------
 // MIDI Rotary Encoders
 //-----------------------------------------------------------------------------
@@ -178,31 +340,115 @@ unsigned int get_zynswitch_dtus(uint8_t i);
 // Number of ticks per retent in rotary encoders
 #define ZYNCODER_TICKS_PER_RETENT 4
 
-// 17 pins / 2 pins per encoder = 8 maximum encoders
-#define MAX_NUM_ZYNCODERS 8
+// 17 pins / 2 pins per encoder = 8 encoders in RPi => more with GPIO expanders
+#define MAX_NUM_ZYNCODERS 64
+
+// Acceleration profile (step==0 mode) => curve from the average tick interval (us) to the
+// subticks per tick multiplier, in fixed point Q8. Piecewise linear between points, which must
+// have ascending intervals. Ticks closer than debounce_us are ignored.
+#define ZYNCODER_ACCEL_MAX_POINTS 8
+struct zyncoder_accel_st {
+	unsigned int debounce_us;
+	_Atomic unsigned int npoints;
+	unsigned int dtus[ZYNCODER_ACCEL_MAX_POINTS];
+	unsigned int mult_q8[ZYNCODER_ACCEL_MAX_POINTS];
+};
+
+// Quadrature transitions per step => 1 << mode
+enum zyncoder_step_mode_enum {
+	ZYNCODER_QUARTER_STEP=0,
+	ZYNCODER_HALF_STEP=1,
+	ZYNCODER_FULL_STEP=2
+};
 
+// Hot state => used by ISRs & jack_process, packed in about a cache line
 struct zyncoder_st {
 	uint8_t enabled;
 	uint8_t pin_a;
 	uint8_t pin_b;
-#ifdef MCP23017_ENCODERS
 	volatile uint8_t pin_a_last_state;
 	volatile uint8_t pin_b_last_state;
-#endif
-	uint8_t midi_chan;
-	uint8_t midi_ctrl;
-	char osc_path[512];
+	uint8_t step_mode;
+	volatile int8_t step_acc;
+	volatile uint8_t last_encoded;
 	unsigned int max_value;
 	unsigned int step;
 	volatile unsigned int subvalue;
 	volatile unsigned int value;
-	volatile unsigned int last_encoded;
+	volatile unsigned int invalid_count;
 	volatile unsigned long tsus;
+	//Tick intervals history => ring, with running sum
 	unsigned int dtus[ZYNCODER_TICKS_PER_RETENT];
+	uint8_t dtus_index;
+	unsigned int dtus_sum;
+	unsigned int accel_frac;
+};
+int num_zyncoders;
+struct zyncoder_st *zyncoders;
+
+// Cold config => bindings & acceleration profile
+struct zyncoder_config_st {
+	uint8_t midi_chan;
+	uint8_t midi_ctrl;
+	struct zyncoder_accel_st accel;
+	char osc_path[512];
+	//Preserialized OSC message => padded path, type tags & argument
+	uint16_t osc_msg_len;
+	uint16_t osc_tag_offset;
+	uint8_t osc_msg[512+8];
 };
-struct zyncoder_st zyncoders[MAX_NUM_ZYNCODERS];
+struct zyncoder_config_st *zyncoders_config;
+
+// Reverse index: MIDI channel & controller => bitmask of bound zyncoders
+typedef uint64_t zyncoder_mask_t;
+zyncoder_mask_t zyncoder_midi_ctrl_map[16][128];
+
+//Pull mode => MIDI encoders don't send from the ISR. Changed encoders are flagged and
+//jack_process sends one CC per encoder per cycle, with the latest value.
+void set_zyncoders_pull_mode(int enabled);
+//OSC encoders are sent from a thread, in bundles with the latest values of the changed
+//encoders. At most one bundle every interval_us (default 10000).
+void set_zyncoder_osc_interval(unsigned int interval_us);
+//Send the encoder OSC message now, from the caller thread. Returns 0 if sent.
+int send_zyncoder_osc(uint8_t i);
+//OSC server => incoming messages on a zyncoder osc_path (i, f, T/F) set its value, without
+//sending it back. Every change is recorded in a queue, read by the UI thread.
+int init_zyncoder_osc_server(int port);
+int end_zyncoder_osc_server();
+//Returns 1 if a change was read
+int read_zyncoder_osc_change(uint8_t *i, unsigned int *value);
 
 struct zyncoder_st *setup_zyncoder(uint8_t i, uint8_t pin_a, uint8_t pin_b, uint8_t midi_chan, uint8_t midi_ctrl, char *osc_path, unsigned int value, unsigned int max_value, unsigned int step); 
+void disable_zyncoder(uint8_t i);
+void set_zyncoder_step_mode(uint8_t i, enum zyncoder_step_mode_enum mode);
+//Returns 0 if the profile is not valid. npoints=0 => default profile.
+int setup_zyncoder_accel(uint8_t i, unsigned int debounce_us, unsigned int npoints, unsigned int *dtus, unsigned int *mult_q8);
+//Invalid quadrature transitions (both pins changed => bouncing or missed edges)
+unsigned int get_zyncoder_invalid_count(uint8_t i);
 unsigned int get_value_zyncoder(uint8_t i);
 void set_value_zyncoder(uint8_t i, unsigned int v, int send);
 
+
+#ifdef MCP23017_ENCODERS
+//-----------------------------------------------------------------------------
+// MCP23017 based encoders & switches
+//-----------------------------------------------------------------------------
+
+// I2C bus clock, used for estimating the bus time spent by the ISR
+#ifndef MCP23017_I2C_CLOCK_HZ
+#define MCP23017_I2C_CLOCK_HZ 100000
+#endif
+
+struct mcp23017_isr_stats_st {
+	unsigned int interrupts;
+	unsigned int transfers;
+	unsigned int bytes;
+	unsigned int errors;
+	unsigned long bus_us;
+	// edges only seen in INTCAP => they would be lost reading GPIO alone
+	unsigned int captured_edges;
+};
+
+void get_mcp23017_isr_stats(struct mcp23017_isr_stats_st *stats);
+void reset_mcp23017_isr_stats();
+#endif
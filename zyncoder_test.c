@@ -28,9 +28,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <lo/lo.h>
 
 #include "zyncoder.h"
+#if defined(MCP23017_ENCODERS) && !defined(HAVE_WIRINGPI_LIB)
+#include "wiringPiEmu.h"
+#endif
 
 #ifndef MCP23017_ENCODERS
 //PROTOTYPE-3
@@ -46,12 +52,399 @@ unsigned int zyncoder_pin_b[4] = { 101, 104, 109, 112 };
 unsigned int zynswitch_pin[4]  = { 100, 103, 108, 111 };
 #endif
 
-int main() {
+#define OSC_BENCH_PATH "/zyncoder/bench"
+
+double elapsed_ns(struct timespec *t0, struct timespec *t1) {
+	return (t1->tv_sec-t0->tv_sec)*1e9 + (t1->tv_nsec-t0->tv_nsec);
+}
+
+//OSC microbenchmark => lo_send per value vs preserialized message over connected socket
+void osc_bench(int n) {
+	int i;
+	struct timespec t0, t1;
+	lo_address addr=lo_address_new(NULL,"6699");
+	setup_zyncoder(0,zyncoder_pin_a[0],zyncoder_pin_b[0],0,0,OSC_BENCH_PATH,0,127,1);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0;i<n;i++) lo_send(addr,OSC_BENCH_PATH,"i",i & 0x7F);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("lo_send: %.0f ns/msg\n", elapsed_ns(&t0,&t1)/n);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0;i<n;i++) {
+		set_value_zyncoder(0,i & 0x7F,0);
+		send_zyncoder_osc(0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("preserialized: %.0f ns/msg\n", elapsed_ns(&t0,&t1)/n);
+
+	lo_address_free(addr);
+}
+
+//MIDI filter event map microbenchmark => random lookups, as done by jack_process,
+//on the struct map vs the packed map. "warm" runs the lookups back to back; "cold"
+//evicts the caches between batches of FILTER_BENCH_BATCH lookups, as the rest of
+//the system does between JACK cycles.
+#define FILTER_BENCH_LOOKUPS (1<<16)
+#define FILTER_BENCH_BATCH 64
+#define FILTER_BENCH_EVICT (8<<20)
+
+unsigned int filter_bench_struct(struct midi_filter_st *mf, uint16_t *lookups, int n) {
+	unsigned int sum=0;
+	int i;
+	for (i=0;i<n;i++) {
+		uint16_t k=lookups[i];
+		struct midi_event_st *ev=&mf->event_map[k>>11][(k>>7) & 0xF][k & 0x7F];
+		sum+=ev->type+ev->chan+ev->num;
+	}
+	return sum;
+}
+
+unsigned int filter_bench_packed(struct midi_filter_st *mf, uint16_t *lookups, int n) {
+	unsigned int sum=0;
+	int i;
+	for (i=0;i<n;i++) {
+		uint16_t k=lookups[i];
+		uint16_t pev=mf->event_map_packed[k>>11][(k>>7) & 0xF][k & 0x7F];
+		sum+=MF_PACKED_TYPE(pev)+MF_PACKED_CHAN(pev)+MF_PACKED_NUM(pev);
+	}
+	return sum;
+}
+
+void filter_bench(int n) {
+	int i, j, m;
+	struct timespec t0, t1;
+	uint16_t *lookups=malloc(FILTER_BENCH_LOOKUPS*sizeof(uint16_t));
+	unsigned char *evict=malloc(FILTER_BENCH_EVICT);
+	unsigned int sum=0;
+	double t_struct=0, t_packed=0;
+
+	//Some non-THRU mappings, so both maps are not trivially uniform
+	for (i=0;i<128;i+=3) set_midi_filter_event_map(CTRL_CHANGE,0,i,CTRL_CHANGE,1,127-i);
+	for (i=0;i<FILTER_BENCH_LOOKUPS;i++) lookups[i]=rand() & 0x3FFF;
+	memset(evict,1,FILTER_BENCH_EVICT);
+	struct midi_filter_st *mf=view_midi_filter();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j=0;j<n;j++) sum+=filter_bench_struct(mf,lookups,FILTER_BENCH_LOOKUPS);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("warm struct map: %.2f ns/lookup\n", elapsed_ns(&t0,&t1)/((double)n*FILTER_BENCH_LOOKUPS));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j=0;j<n;j++) sum+=filter_bench_packed(mf,lookups,FILTER_BENCH_LOOKUPS);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("warm packed map: %.2f ns/lookup\n", elapsed_ns(&t0,&t1)/((double)n*FILTER_BENCH_LOOKUPS));
+
+	//Alternate both maps on the same batches, so they see the same cache state
+	for (j=0;j<n;j++) {
+		for (i=0;i+FILTER_BENCH_BATCH<=FILTER_BENCH_LOOKUPS;i+=FILTER_BENCH_BATCH) {
+			for (m=0;m<FILTER_BENCH_EVICT;m+=64) sum+=evict[m]++;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			sum+=filter_bench_struct(mf,lookups+i,FILTER_BENCH_BATCH);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			t_struct+=elapsed_ns(&t0,&t1);
+			for (m=0;m<FILTER_BENCH_EVICT;m+=64) sum+=evict[m]++;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			sum+=filter_bench_packed(mf,lookups+i,FILTER_BENCH_BATCH);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			t_packed+=elapsed_ns(&t0,&t1);
+		}
+	}
+	m=n*(FILTER_BENCH_LOOKUPS/FILTER_BENCH_BATCH)*FILTER_BENCH_BATCH;
+	printf("cold struct map: %.2f ns/lookup\n", t_struct/m);
+	printf("cold packed map: %.2f ns/lookup\n", t_packed/m);
+
+	//Keep the sums alive
+	if (sum==0) printf("\n");
+	free(evict);
+	free(lookups);
+}
+
+//MIDI filter CC swap test => set/del/get sequences, verifying the swap graph after every step.
+//Expected result <0 => any result is fine.
+int cc_swap_errors=0;
+
+void cc_swap_check(const char *step, int res, int expected) {
+	int errors=check_midi_filter_cc_swap();
+	if ((expected>=0 && res!=expected) || errors) {
+		printf("CC swap FAIL: %s => returned %d (expected %d), %d graph errors\n", step, res, expected, errors);
+		cc_swap_errors++;
+	}
+}
+
+int cc_swap_test(int n) {
 	int i;
+	char step[64];
+
+	reset_midi_filter_cc_map();
+	cc_swap_check("reset",0,0);
+
+	//Simple swap & lookup
+	cc_swap_check("set 0:1 => 0:2",set_midi_filter_cc_swap(0,1,0,2),1);
+	cc_swap_check("get 0:2",get_midi_filter_cc_swap(0,2),1);
+	//Rejected => origin/destiny already mapped
+	cc_swap_check("set 0:1 => 0:7",set_midi_filter_cc_swap(0,1,0,7),0);
+	cc_swap_check("set 0:7 => 0:2",set_midi_filter_cc_swap(0,7,0,2),0);
+	//Chain 0:2 => 0:3 => 0:4
+	cc_swap_check("set 0:2 => 0:3",set_midi_filter_cc_swap(0,2,0,3),1);
+	cc_swap_check("set 0:3 => 0:4",set_midi_filter_cc_swap(0,3,0,4),1);
+	cc_swap_check("get 0:4",get_midi_filter_cc_swap(0,4),3);
+	//Across channels
+	cc_swap_check("set 0:10 => 1:20",set_midi_filter_cc_swap(0,10,1,20),1);
+	//Self-loop
+	cc_swap_check("set 0:5 => 0:5",set_midi_filter_cc_swap(0,5,0,5),1);
+	cc_swap_check("get 0:5",get_midi_filter_cc_swap(0,5),5);
+	//Delete from the middle of the chain, then the rest
+	cc_swap_check("del 0:2",del_midi_filter_cc_swap(0,2),1);
+	cc_swap_check("del 0:1",del_midi_filter_cc_swap(0,1),1);
+	cc_swap_check("del 0:3",del_midi_filter_cc_swap(0,3),1);
+	cc_swap_check("del 0:5",del_midi_filter_cc_swap(0,5),1);
+	cc_swap_check("del 0:10",del_midi_filter_cc_swap(0,10),1);
+
+	//Random sequences on a small set of nodes, so chains & loops are frequent
+	srand(1);
+	for (i=0;i<n;i++) {
+		uint8_t chan_from=rand()%2, num_from=rand()%8;
+		uint8_t chan_to=rand()%2, num_to=rand()%8;
+		switch (rand()%3) {
+			case 0:
+				sprintf(step,"#%d set %d:%d => %d:%d",i,chan_from,num_from,chan_to,num_to);
+				cc_swap_check(step,set_midi_filter_cc_swap(chan_from,num_from,chan_to,num_to),-1);
+				break;
+			case 1:
+				sprintf(step,"#%d del %d:%d",i,chan_from,num_from);
+				cc_swap_check(step,del_midi_filter_cc_swap(chan_from,num_from),-1);
+				break;
+			case 2:
+				sprintf(step,"#%d get %d:%d",i,chan_to,num_to);
+				cc_swap_check(step,get_midi_filter_cc_swap(chan_to,num_to),-1);
+				break;
+		}
+	}
+
+	reset_midi_filter_cc_map();
+	cc_swap_check("reset",0,0);
+	printf("CC swap test: %s (%d failed steps)\n", cc_swap_errors ? "FAIL" : "PASS", cc_swap_errors);
+	return cc_swap_errors ? 1 : 0;
+}
+
+//OSC server test => messages sent to the server must set the zyncoder value & be read back
+//from the changes queue
+#define OSC_SERVER_TEST_PORT 6698
+#define OSC_SERVER_TEST_PATH "/zyncoder/server"
+
+int osc_server_test_read(const char *step, unsigned int expected) {
+	uint8_t i;
+	unsigned int value;
+	int ms;
+	//Messages are handled by the server thread => wait for them
+	for (ms=0;ms<1000;ms++) {
+		if (read_zyncoder_osc_change(&i,&value)) {
+			if (i==0 && value==expected && get_value_zyncoder(0)==expected) return 0;
+			printf("OSC server FAIL: %s => zyncoder %d = %u (expected 0 = %u)\n", step, i, value, expected);
+			return 1;
+		}
+		usleep(1000);
+	}
+	printf("OSC server FAIL: %s => no change read\n", step);
+	return 1;
+}
+
+int osc_server_test() {
+	int errors=0;
+	char port_str[8];
+	sprintf(port_str,"%d",OSC_SERVER_TEST_PORT);
+	lo_address addr=lo_address_new(NULL,port_str);
+	if (init_zyncoder_osc_server(OSC_SERVER_TEST_PORT)) {
+		printf("OSC server FAIL: can't start server\n");
+		return 1;
+	}
+	setup_zyncoder(0,zyncoder_pin_a[0],zyncoder_pin_b[0],0,0,OSC_SERVER_TEST_PATH,0,127,1);
+
+	lo_send(addr,OSC_SERVER_TEST_PATH,"i",42);
+	errors+=osc_server_test_read("int",42);
+	lo_send(addr,OSC_SERVER_TEST_PATH,"f",99.6);
+	errors+=osc_server_test_read("float",100);
+	lo_send(addr,OSC_SERVER_TEST_PATH,"T");
+	errors+=osc_server_test_read("true",127);
+	//Values are clamped to the zyncoder range
+	lo_send(addr,OSC_SERVER_TEST_PATH,"i",1000);
+	errors+=osc_server_test_read("clamped",127);
+
+	//Queue was never full
+	if (get_zyncoder_error_count(ZYNCODER_ERR_OSC_CHANGES_FULL)!=0) {
+		printf("OSC server FAIL: %u changes queue full errors\n", get_zyncoder_error_count(ZYNCODER_ERR_OSC_CHANGES_FULL));
+		errors++;
+	}
+
+	lo_address_free(addr);
+	end_zyncoder_osc_server();
+	printf("OSC server test: %s\n", errors ? "FAIL" : "PASS");
+	return errors ? 1 : 0;
+}
+
+#if defined(MCP23017_ENCODERS) && !defined(HAVE_WIRINGPI_LIB)
+//MCP23017 emulator test => edges changing again before the ISR reads the chip must be taken
+//from INTCAP. Interrupts are deferred, so the pins change twice before the ISR runs.
+int mcp23017_test() {
+	int errors=0;
+	struct mcp23017_isr_stats_st stats;
+	//Encoder 0 => A on bank A bit 2, B on bit 1. Switch 0 => bank A bit 0. Pull-ups => idle high.
+	struct zynswitch_st *zynswitch=setup_zynswitch(0,zynswitch_pin[0]);
+	setup_zyncoder(0,zyncoder_pin_a[0],zyncoder_pin_b[0],0,70,NULL,64,127,1);
+	mcp23017EmuSetPins(0xFFFF);
+	reset_mcp23017_isr_stats();
+	mcp23017EmuSetDeferredInts(1);
+
+	//Switch press released before the read => only INTCAP has it, counted as a minimum length press
+	get_zynswitch_dtus(0);
+	mcp23017EmuSetPins(0xFFFE);
+	mcp23017EmuSetPins(0xFFFF);
+	mcp23017EmuDeliverInts();
+	get_mcp23017_isr_stats(&stats);
+	unsigned int dtus=get_zynswitch_dtus(0);
+	if (dtus==0 || zynswitch->status!=1) {
+		printf("MCP23017 FAIL: switch press lost (dtus=%u, status=%d)\n", dtus, zynswitch->status);
+		errors++;
+	}
+	if (stats.captured_edges!=1) {
+		printf("MCP23017 FAIL: captured edges %u (expected 1)\n", stats.captured_edges);
+		errors++;
+	}
+
+	//Encoder A & B falling before the read => INTCAP has A, GPIO has both => 2 valid transitions
+	unsigned int value=get_value_zyncoder(0);
+	unsigned int invalid=get_zyncoder_invalid_count(0);
+	mcp23017EmuSetPins(0xFFFB);
+	mcp23017EmuSetPins(0xFFF9);
+	mcp23017EmuDeliverInts();
+	if (get_zyncoder_invalid_count(0)!=invalid || get_value_zyncoder(0)==value) {
+		printf("MCP23017 FAIL: encoder value %u => %u, %u invalid transitions\n", value, get_value_zyncoder(0), get_zyncoder_invalid_count(0)-invalid);
+		errors++;
+	}
+	mcp23017EmuSetDeferredInts(0);
+
+	get_mcp23017_isr_stats(&stats);
+	printf("MCP23017 ISR: %u interrupts, %u transfers, %u bytes, %u errors, %u captured edges\n",
+		stats.interrupts, stats.transfers, stats.bytes, stats.errors, stats.captured_edges);
+	if (stats.interrupts>0) printf("MCP23017 ISR: %lu us of I2C bus time per interrupt\n", stats.bus_us/stats.interrupts);
+	printf("MCP23017 test: %s\n", errors ? "FAIL" : "PASS");
+	return errors ? 1 : 0;
+}
+#endif
+
+#ifndef MCP23017_ENCODERS
+//Simulated GPIO test => quadrature sequences & switch presses injected with given timestamps (us)
+unsigned long gpio_sim_tsus=1000000;
+
+//One quadrature cycle (4 transitions) from idle (A=B=1), "dtus" apart. Up => A leads.
+void gpio_sim_encoder_cycle(uint8_t pin_a, uint8_t pin_b, int up, unsigned int dtus) {
+	uint8_t first=up ? pin_a : pin_b;
+	uint8_t second=up ? pin_b : pin_a;
+	set_zyncoder_gpio_sim_pin(first, 0, gpio_sim_tsus+=dtus);
+	set_zyncoder_gpio_sim_pin(second, 0, gpio_sim_tsus+=dtus);
+	set_zyncoder_gpio_sim_pin(first, 1, gpio_sim_tsus+=dtus);
+	set_zyncoder_gpio_sim_pin(second, 1, gpio_sim_tsus+=dtus);
+}
+
+int gpio_sim_test() {
+	int errors=0;
+	int value, n;
+	unsigned int dtus;
+
+	//Encoder 0 => step mode, quarter step => every transition is a step
+	setup_zyncoder(0,zyncoder_pin_a[0],zyncoder_pin_b[0],0,70,NULL,64,127,1);
+	gpio_sim_encoder_cycle(zyncoder_pin_a[0],zyncoder_pin_b[0],1,50000);
+	value=get_value_zyncoder(0);
+	gpio_sim_encoder_cycle(zyncoder_pin_a[0],zyncoder_pin_b[0],0,50000);
+	if ((value!=60 && value!=68) || get_value_zyncoder(0)!=64 || get_zyncoder_invalid_count(0)!=0) {
+		printf("GPIO SIM FAIL: step encoder 64 => %d => %d, %u invalid transitions\n", value, get_value_zyncoder(0), get_zyncoder_invalid_count(0));
+		errors++;
+	}
+	int up=(value==68);
+	int sign=up ? 1 : -1;
+
+	//Encoder 1 => acceleration with the default profile (x4 under 10 ms, x1 over 30 ms)
+	setup_zyncoder(1,zyncoder_pin_a[1],zyncoder_pin_b[1],0,71,NULL,64,127,0);
+	for (n=0;n<2;n++) gpio_sim_encoder_cycle(zyncoder_pin_a[1],zyncoder_pin_b[1],up,50000);
+	int slow=sign*(get_value_zyncoder(1)-64);
+	for (n=0;n<5;n++) gpio_sim_encoder_cycle(zyncoder_pin_a[1],zyncoder_pin_b[1],up,2000);
+	int fast=sign*(get_value_zyncoder(1)-64)-slow;
+	printf("GPIO SIM: encoder moved %d in 8 slow transitions, %d in 20 fast ones\n", slow, fast);
+	if (slow!=2 || fast<15 || get_zyncoder_invalid_count(1)!=0) {
+		printf("GPIO SIM FAIL: acceleration %d slow, %d fast (expected 2, >=15), %u invalid transitions\n", slow, fast, get_zyncoder_invalid_count(1));
+		errors++;
+	}
+
+	//Switch 1 => a 120 ms press & a 300 us bounce
+	setup_zynswitch(1,zynswitch_pin[1]);
+	get_zynswitch_dtus(1);
+	set_zyncoder_gpio_sim_pin(zynswitch_pin[1], 0, gpio_sim_tsus+=100000);
+	set_zyncoder_gpio_sim_pin(zynswitch_pin[1], 1, gpio_sim_tsus+=120000);
+	dtus=get_zynswitch_dtus(1);
+	if (dtus!=120000) {
+		printf("GPIO SIM FAIL: switch press %u us (expected 120000)\n", dtus);
+		errors++;
+	}
+	set_zyncoder_gpio_sim_pin(zynswitch_pin[1], 0, gpio_sim_tsus+=100000);
+	set_zyncoder_gpio_sim_pin(zynswitch_pin[1], 1, gpio_sim_tsus+=300);
+	dtus=get_zynswitch_dtus(1);
+	if (dtus!=0) {
+		printf("GPIO SIM FAIL: switch bounce taken as a %u us press\n", dtus);
+		errors++;
+	}
+
+	printf("GPIO SIM test: %s\n", errors ? "FAIL" : "PASS");
+	return errors ? 1 : 0;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+	int i;
+
+#ifndef MCP23017_ENCODERS
+	//Simulated pins => the backend must be set before initializing the library
+	if (argc>1 && strcmp(argv[1],"gpio-sim-test")==0) set_zyncoder_gpio_backend(ZYNCODER_GPIO_SIM, NULL);
+#endif
 
 	printf("INITIALIZING ZYNCODER LIBRARY!\n");
 	init_zyncoder(6699);
 
+	if (argc>1 && strcmp(argv[1],"osc-bench")==0) {
+		osc_bench(argc>2 ? atoi(argv[2]) : 100000);
+		end_zyncoder();
+		return 0;
+	}
+	if (argc>1 && strcmp(argv[1],"osc-server-test")==0) {
+		int res=osc_server_test();
+		end_zyncoder();
+		return res;
+	}
+	if (argc>1 && strcmp(argv[1],"cc-swap-test")==0) {
+		int res=cc_swap_test(argc>2 ? atoi(argv[2]) : 1000);
+		end_zyncoder();
+		return res;
+	}
+#if defined(MCP23017_ENCODERS) && !defined(HAVE_WIRINGPI_LIB)
+	if (argc>1 && strcmp(argv[1],"mcp23017-test")==0) {
+		int res=mcp23017_test();
+		end_zyncoder();
+		return res;
+	}
+#endif
+#ifndef MCP23017_ENCODERS
+	if (argc>1 && strcmp(argv[1],"gpio-sim-test")==0) {
+		int res=gpio_sim_test();
+		end_zyncoder();
+		return res;
+	}
+#endif
+	if (argc>1 && strcmp(argv[1],"filter-bench")==0) {
+		filter_bench(argc>2 ? atoi(argv[2]) : 2);
+		end_zyncoder();
+		return 0;
+	}
+
 	printf("SETTING UP ZYNSWITCHES!\n");
 	for (i=0;i<4;i++) {
 		setup_zynswitch(i,zynswitch_pin[i]);